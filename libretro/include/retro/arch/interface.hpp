@@ -44,6 +44,11 @@ namespace retro::arch {
 		virtual bool		 disasm(std::span<const u8> data, minsn* out)		  = 0;
 		virtual diag::lazy lift(ir::basic_block* bb, const minsn& ins, u64 ip) = 0;
 
+		// Machine code details.
+		//
+		virtual minsn_flow			get_flow(const minsn& ins) { return minsn_flow::unknown; }
+		virtual std::optional<u64> resolve_ip_relative(const minsn& ins, const mem& m, u64 ip) { return std::nullopt; }
+
 		// Formatting.
 		//
 		virtual std::string_view name_register(mreg r)						 = 0;
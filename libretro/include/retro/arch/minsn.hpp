@@ -96,6 +96,18 @@ namespace retro::arch {
 		}
 	};
 
+	// Control flow of an instruction, for the analyses walking the code without lifting it.
+	// - Targets are given by the relative immediate operands.
+	//
+	enum class minsn_flow : u8 {
+		unknown,	 // Not classified by the architecture.
+		next,		 // Continues with the next instruction.
+		call,		 // Calls the target and continues with the next instruction.
+		branch,	 // Continues with the target or the next instruction.
+		jump,		 // Continues with the target, or an unknown location if indirect.
+		stop,		 // Does not continue, e.g. returns or traps.
+	};
+
 	// Instruction type.
 	//
 	static constexpr size_t max_mop_count = 8;
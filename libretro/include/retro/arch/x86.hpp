@@ -56,6 +56,11 @@ namespace retro::arch {
 		bool		  disasm(std::span<const u8> data, minsn* out);
 		diag::lazy lift(ir::basic_block* bb, const minsn& ins, u64 ip);
 
+		// Machine code details.
+		//
+		minsn_flow			  get_flow(const minsn& ins);
+		std::optional<u64> resolve_ip_relative(const minsn& ins, const mem& m, u64 ip);
+
 		// Formatting.
 		//
 		std::string_view name_register(mreg r);
@@ -8,14 +8,18 @@
 //
 namespace retro::core {
 	// Handles lifting of instructions.
+	// - Blocks of a discovery round may be decoded in parallel (see parallel_discovery_min), so this can run concurrently for different
+	//   blocks of the same method. Handlers may only modify the given block and must not look at the other blocks of the routine.
 	//
 	inline handler_list<arch::handle, ir::basic_block*, arch::minsn&, u64> on_minsn_lift;
 
 	// Handles resolution of an XJMP instruction with non-constant target, for instance in the case of jump tables.
+	// - Invoked while linking the blocks, which is sequential for each method.
 	//
 	inline handler_list<method*, ir::insn*> indirect_xjmp_resolver = {};
 
 	// Handlers invoked on creation of an XCALL instruction.
+	// - Runs during decoding under the same rules as on_minsn_lift, handlers may only modify the instruction and its block.
 	//
 	inline handler_list<ir::insn*> on_irp_init_xcall = {};
 
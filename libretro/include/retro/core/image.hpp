@@ -7,6 +7,8 @@
 #include <retro/interface.hpp>
 #include <retro/robin_hood.hpp>
 #include <retro/umutex.hpp>
+#include <retro/neo.hpp>
+#include <retro/core/minsn_cache.hpp>
 #include <string>
 #include <vector>
 #include <variant>
@@ -104,6 +106,41 @@ namespace retro::core {
 		return nullptr;
 	}
 
+	// Progress counters of the whole-image method discovery.
+	//
+	struct discovery_progress {
+		std::atomic<u64> rounds				  = 0;	 // Fixed point iterations completed.
+		std::atomic<u64> methods_queued	  = 0;	 // Unique method RVAs queued for lifting.
+		std::atomic<u64> methods_lifted	  = 0;	 // Methods lifted successfully.
+		std::atomic<u64> methods_failed	  = 0;	 // Methods that could not be lifted.
+		std::atomic<u64> blocks_lifted	  = 0;	 // Basic blocks and instructions of the lifted methods.
+		std::atomic<u64> insns_lifted		  = 0;
+		std::atomic<u64> methods_truncated = 0;	 // Methods whose lifting hit the budget.
+	};
+
+	// Limits applied to the lifting of each method, zero means unlimited.
+	// - Read as the methods are lifted, changes apply to the ones in progress as well.
+	// - Time limits are soft caps checked between steps, a single Z3 query that started within the budget is not interrupted.
+	//
+	struct lift_budget {
+		std::atomic<u64> max_blocks	  = 0;	 // Basic blocks decoded.
+		std::atomic<u64> max_insns		  = 0;	 // IR instructions lifted.
+		std::atomic<u64> max_time_ns	  = 0;	 // Wall time of the control flow discovery.
+		std::atomic<u64> max_z3_time_ns = 0;	 // Time spent in Z3 during the control flow discovery.
+	};
+
+	// Index of the identical methods in an image.
+	// - Fingerprint -> RVA of the first method lifted with it, whose routine the duplicates rebase.
+	//
+	struct dedup_index {
+		mutable spinlock	  lock		 = {};
+		flat_umap<u64, u64> templates = {};
+
+		std::atomic<bool> enabled	= true;
+		std::atomic<u64>	hits		= 0;	// Methods rebased from an identical one.
+		std::atomic<u64>	rejected = 0;	// Fingerprint matches that did not verify.
+	};
+
 	// Image type.
 	//
 	struct workspace;
@@ -150,6 +187,36 @@ namespace retro::core {
 		mutable shared_umutex		 method_map_mtx = {};
 		flat_umap<u64, ref<method>> method_map		  = {};
 
+		// Decoded instructions keyed by RVA.
+		//
+		minsn_cache decode_cache = {};
+
+		// Identical methods.
+		//
+		dedup_index dedup = {};
+
+		// Progress of the whole-image method discovery.
+		//
+		discovery_progress discovery = {};
+
+		// Limits applied to the lifting of each method.
+		//
+		lift_budget lift_limits = {};
+
+		// Patched RVA ranges whose methods are not yet re-lifted.
+		//
+		mutable spinlock					  dirty_lock	 = {};
+		std::vector<std::pair<u64, u64>> dirty_ranges = {};
+
+		// Name of the optimization pipeline applied to the methods lifted from this image.
+		//
+		mutable spinlock opt_pipeline_lock = {};
+		std::string		  opt_pipeline		 = "init";
+
+		// Cancellation group of the analysis tasks working on this image.
+		//
+		ref<neo::cancel_group> task_group = neo::cancel_group::create();
+
 		// Observers.
 		//
 		ref<method> lookup_method(u64 rva) const {
@@ -160,6 +227,23 @@ namespace retro::core {
 			return nullptr;
 		}
 
+		// Writes bytes into the image, recording the range as dirty and dropping the cached instructions overlapping it.
+		// - Fails while tasks of the image or lifts are running as they may be reading the bytes.
+		// - core::relift re-lifts the affected methods once done patching.
+		//
+		bool write(u64 rva, std::span<const u8> data);
+
+		// Gets or changes the optimization pipeline.
+		//
+		std::string get_opt_pipeline() const {
+			std::lock_guard _g{opt_pipeline_lock};
+			return opt_pipeline;
+		}
+		void set_opt_pipeline(std::string name) {
+			std::lock_guard _g{opt_pipeline_lock};
+			opt_pipeline = std::move(name);
+		}
+
 		// Finds a section entry given an RVA.
 		//
 		const section* find_section(u64 rva) const {
@@ -28,6 +28,16 @@ namespace retro::core {
 		IRP_MAX,
 	};
 
+	// Lifting budget that cut the discovery of a method short.
+	//
+	enum class lift_limit : u8 {
+		none = 0,
+		blocks,	 // lift_budget::max_blocks
+		insns,	 // lift_budget::max_insns
+		time,		 // lift_budget::max_time_ns
+		z3_time,	 // lift_budget::max_z3_time_ns
+	};
+
 	// Analysis results and statistics for each IRP.
 	//
 	struct irp_init_info {
@@ -36,6 +46,21 @@ namespace retro::core {
 		u64 stats_minsn_disasm = 0;  // Machine instructions diassembled.
 		u64 stats_insn_lifted  = 0;  // IR instructions created to represent the disassembled instructions.
 		u64 stats_block_count  = 0;  // Blocks parsed.
+		u64 stats_z3_time_ns   = 0;  // Time spent in Z3 coercing operands into constants.
+
+		// Budget that was exceeded, if any, the blocks left undecoded end with a trap.
+		//
+		lift_limit limit_hit = lift_limit::none;
+
+		irp_init_info& operator+=(const irp_init_info& o) {
+			stats_minsn_disasm += o.stats_minsn_disasm;
+			stats_insn_lifted += o.stats_insn_lifted;
+			stats_block_count += o.stats_block_count;
+			stats_z3_time_ns += o.stats_z3_time_ns;
+			if (limit_hit == lift_limit::none)
+				limit_hit = o.limit_hit;
+			return *this;
+		}
 	};
 	struct irp_phi_info {
 		// Difference in stack pointer after a call to this function.
@@ -132,12 +157,93 @@ namespace retro::core {
 			}
 		}
 
-		// Lifts a basic block into the IRP_INIT IR from the given RVA.
+		// Blocks queued for decoding during the IRP_INIT control flow discovery.
+		//
+		std::vector<ir::basic_block*> discovery_queue = {};
+
+		// Checks queued by the indirect jump resolvers, run once the discovery is complete and every predecessor is known.
+		// - Returns true if the check reverted the control flow it was guarding.
+		//
+		std::vector<std::function<bool()>> discovery_checks = {};
+
+		// RVA ranges of constant image memory folded into the IR, patching them invalidates the method.
+		//
+		mutable spinlock					  const_reads_lock = {};
+		std::vector<std::pair<u64, u64>> const_reads		 = {};
+
+		// Records a constant read, may be called from local passes running in parallel.
+		//
+		void record_const_read(u64 rva, u64 length) {
+			std::lock_guard _g{const_reads_lock};
+			if (!const_reads.empty() && const_reads.back().first <= rva && rva <= const_reads.back().second) {
+				const_reads.back().second = std::max(const_reads.back().second, rva + length);
+			} else {
+				const_reads.emplace_back(rva, rva + length);
+			}
+		}
+
+		// Checks whether patching the RVA range [begin, end) invalidates the method.
+		//
+		bool depends_on(u64 begin, u64 end) const;
+
+		// Time the IRP_INIT discovery started at.
+		//
+		timestamp discovery_start = {};
+
+		// Checks the lifting budget of the image given the statistics not yet merged into init_info, does not check max_blocks.
+		//
+		lift_limit check_budget(const irp_init_info& pending = {}) const;
+
+		// Discovers the control flow starting from the given RVA and lifts it into the IRP_INIT IR, returns the block at the RVA.
 		//
 		neo::subtask<ir::basic_block*> build_block(u64 rva);
+
+		// Discovery steps.
+		// - Resolves the block starting at the given RVA, splitting a lifted one or queueing a new one for decoding.
+		ir::basic_block* resolve_block(u64 rva);
+		// - Decodes and lifts the instructions of a queued block, only touches the block itself.
+		void decode_block(ir::basic_block* bb, irp_init_info& stats);
+		// - Cuts the decoded blocks that ran into the start of another block.
+		void cut_overlaps(std::span<ir::basic_block* const> batch);
+		// - Links a terminator to its targets, queueing the new ones.
+		void link_terminator(ir::insn* term);
 	};
 
+	// Minimum number of blocks in a discovery round for them to be decoded in parallel, zero disables it.
+	// - The decoding callbacks then run concurrently for different blocks of the same method, see callbacks.hpp.
+	//
+	inline std::atomic<size_t> parallel_discovery_min = 16;
+
 	// Lifts a new method into the image at the given RVA, if it does not already exist.
 	//
 	neo::task<ref<ir::routine>> lift(image* img, u64 rva, arch::handle arch = {});
+
+	// Fingerprints the method at the given RVA by walking its machine code, masking the position dependent operands.
+	// - Returns nullopt if the architecture cannot classify the control flow or the method is too large.
+	//
+	std::optional<u64> fingerprint_method(image* img, arch::handle arch, u64 rva);
+
+	// Rebases the routine of an identical method onto a method that is about to be lifted, or returns null if there is none.
+	//
+	neo::subtask<ref<ir::routine>> rebase_identical(ref<method> m);
+
+	// Re-lifts the methods invalidated by the patches written to the image since the last call, returns the number of methods re-lifted.
+	//
+	neo::task<u64> relift(image* img);
+
+	// Whole-image method discovery.
+	//
+	struct discovery_options {
+		bool entry_points = true;	 // Seed from the image entry points.
+		bool symbols		= true;	 // Seed from the exported symbols.
+		bool relocs			= true;	 // Seed from the relocation targets.
+		bool call_targets = true;	 // Follow the constant targets of calls in the lifted methods.
+		bool code_refs		= false;	 // Follow any other constant pointing into executable sections.
+	};
+
+	// Lifts every method reachable from the seeds of the image to a fixed point, returns the number of methods lifted.
+	// - Progress is reported through image::discovery, reset at the start of every call.
+	// - Methods that fail to lift, including by throwing, are counted as failed without stopping the discovery.
+	//
+	neo::task<u64> discover(image* img, discovery_options opt = {});
 }
\ No newline at end of file
@@ -0,0 +1,81 @@
+#pragma once
+#include <retro/common.hpp>
+#include <retro/arch/interface.hpp>
+#include <retro/arch/minsn.hpp>
+#include <retro/robin_hood.hpp>
+#include <retro/umutex.hpp>
+#include <retro/neo.hpp>
+#include <atomic>
+#include <span>
+#include <vector>
+
+namespace retro::core {
+	// Concurrent cache of decoded machine instructions keyed by RVA.
+	// - Sharded by RVA, each shard holds at most capacity/shard_count entries and evicts the oldest one first.
+	// - Decoding failures are cached as well, with a zero length.
+	//
+	struct minsn_cache {
+		static constexpr size_t shard_count		  = 64;
+		static constexpr size_t default_capacity = 256 * 1024;
+
+		// Entries and the ring slots are tagged with the generation they were inserted at, slots whose entry was since
+		// dropped or inserted again are stale and evict nothing.
+		//
+		struct entry {
+			arch::minsn ins = {};
+			u64			gen = 0;
+		};
+		struct shard {
+			mutable shared_umutex				mtx		= {};
+			flat_umap<u64, entry>				map		= {};
+			std::vector<std::pair<u64, u64>>	order		= {};	// Insertion order of the RVA and generation pairs, used as a ring once full.
+			size_t									cursor	= 0;
+			u64										next_gen	= 0;
+		};
+		shard shards[shard_count] = {};
+
+		// Maximum number of entries.
+		//
+		std::atomic<size_t> capacity = default_capacity;
+
+		// Statistics.
+		//
+		mutable std::atomic<u64> hits	 = 0;
+		mutable std::atomic<u64> misses = 0;
+
+		// Shard of an RVA.
+		//
+		shard&		 shard_of(u64 rva) { return shards[(rva * 0x9E3779B97F4A7C15) >> 58]; }
+		const shard& shard_of(u64 rva) const { return shards[(rva * 0x9E3779B97F4A7C15) >> 58]; }
+
+		// Looks up the instruction at the given RVA decoded by the given architecture.
+		//
+		bool lookup(u64 rva, arch::handle arch, arch::minsn& out) const;
+
+		// Inserts a decoded instruction, evicting the oldest entry of the shard if full.
+		//
+		void insert(u64 rva, const arch::minsn& ins);
+
+		// Decodes the instruction at the given RVA through the cache, returns false on failure.
+		//
+		bool decode(arch::handle arch, std::span<const u8> data, u64 rva, arch::minsn& out);
+
+		// Drops every entry overlapping [begin, end).
+		//
+		void invalidate(u64 begin, u64 end);
+
+		// Drops every entry.
+		//
+		void clear();
+
+		// Number of entries.
+		//
+		size_t size() const;
+	};
+
+	// Fills the decode cache of the image with a parallel linear sweep over its executable sections, returns the number of instructions decoded.
+	// - Stops early once the cache is full.
+	//
+	struct image;
+	neo::task<u64> predecode(image* img, arch::handle arch = {});
+};
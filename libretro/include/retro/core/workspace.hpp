@@ -27,5 +27,9 @@ namespace retro::core {
 		//
 		diag::expected<ref<image>> load_image(const std::filesystem::path& path, ldr::handle ldr = std::nullopt);
 		diag::expected<ref<image>> load_image_in_memory(std::span<const u8> data, ldr::handle ldr = std::nullopt);
+
+		// Removes an image from the workspace and cancels the tasks working on it, returns false if not found.
+		//
+		bool close_image(image* img);
 	};
 };
\ No newline at end of file
@@ -31,6 +31,11 @@ namespace retro::ir {
 		std::vector<weak<basic_block>> successors	  = {};
 		std::vector<weak<basic_block>> predecessors = {};
 
+		// Index of the first instruction of each IP in the block, sorted.
+		// - Appended to by the lifter once each instruction is lifted and split along with the block, stale entries cause a rebuild on lookup.
+		//
+		std::vector<std::pair<u64, weak<insn>>> ip_index = {};
+
 		// Container observers.
 		//
 		list::iterator<insn> end_phi() const {
@@ -104,6 +109,11 @@ namespace retro::ir {
 		//
 		basic_block* split(list::iterator<insn> boundary);
 
+		// Finds the first instruction with the given IP, null if there is none.
+		//
+		insn* find_ip(u64 ip);
+		void	rebuild_ip_index();
+
 		// Validation.
 		//
 		diag::lazy validate() const;
@@ -6,6 +6,7 @@
 #include <retro/ir/basic_block.hpp>
 #include <retro/graph/search.hpp>
 #include <vector>
+#include <map>
 
 namespace retro::core { struct method; };
 
@@ -25,10 +26,10 @@ namespace retro::ir {
 		//
 		u64 ip = NO_LABEL;
 
-		// Counters.
+		// Counters, instruction names are atomic as local passes may run on the blocks in parallel.
 		//
-		mutable u32 next_ins_name = 0;  // Next instruction name.
-		mutable u32 next_blk_name = 0;  // Next basic-block name.
+		mutable std::atomic<u32> next_ins_name = 0;	// Next instruction name.
+		mutable u32					 next_blk_name = 0;	// Next basic-block name.
 
 		// Last control flow modification time.
 		//
@@ -39,6 +40,11 @@ namespace retro::ir {
 		container blocks = {};
 		weak<basic_block> entry_point = {};
 
+		// Interval index of the blocks by their starting IP, the end of each range is read from the block itself.
+		// - Maintained by add_block, split and del_block, blocks without an IP are not indexed.
+		//
+		std::map<u64, basic_block*> block_index = {};
+
 		// Container observers.
 		//
 		iterator			begin() { return blocks.begin(); }
@@ -50,9 +56,17 @@ namespace retro::ir {
 
 		// Creates or removes a block.
 		//
-		basic_block* add_block();
+		basic_block* add_block(u64 ip = NO_LABEL);
 		void del_block(basic_block* b);
 
+		// Removes the blocks that cannot be reached from the entry point, returns the number of blocks removed.
+		//
+		size_t del_unreachable_blocks();
+
+		// Finds the block whose IP range contains the given IP, or the one starting at it.
+		//
+		basic_block* find_block(u64 ip) const;
+
 		// Topologically sorts the basic block list.
 		//
 		void topological_sort();
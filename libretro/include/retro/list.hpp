@@ -99,6 +99,14 @@ namespace retro::list {
 		val->prev  = at;
 		val->next  = next;
 	}
+	// - Links a detached chain (circular list with no head, starting at first) before at.
+	template<typename T, typename T2 = T>
+	RC_INLINE static void splice_before(T* at, T2* first) {
+		auto* prev = std::exchange(at->prev, first->prev);
+		auto* last = std::exchange(first->prev, prev);
+		prev->next = first;
+		last->next = at;
+	}
 	// - Unlinks the value from the list.
 	template<typename T>
 	RC_INLINE static void unlink(T* val) {
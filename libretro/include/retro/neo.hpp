@@ -18,7 +18,7 @@
 // Tasks:
 //  - Should not have any side effects if cancelled.
 //  - Scheduled in a specific domain (instance of neo::scheduler).
-//  - Should only await on another subtask.
+//  - Should only await on another subtask or a promise, awaiting a promise parks the task until it settles.
 //  - Does not start autoamtically on creation, user has to push it into a scheduler and receive a task_ref.
 //
 // Subtasks:
@@ -38,6 +38,30 @@ namespace retro::neo {
 	};
 	static constexpr auto time_slice_coeff = 150ms;
 
+	// Checkpoints only decrement a budget, the slow path runs roughly once per interval by adapting the refill.
+	//
+	static constexpr auto checkpoint_interval = 1ms;
+	static constexpr u32	 max_tick_refill	  = 1u << 16;
+
+	// Slices of the deterministic mode are counted in checkpoints instead of time, per priority unit.
+	//
+	static constexpr u32 deterministic_slice_ticks = 4096;
+
+	// Priority levels, each one is a separate run queue.
+	// - Interactive level (high and above) is always served first and preempts lower levels.
+	// - The remaining levels are served by deadline, queue time delayed by the aging interval per level, so low tasks cannot starve.
+	//
+	static constexpr size_t num_priority_levels		= 3;
+	static constexpr auto	priority_aging_interval = 2 * time_slice_coeff;
+	RC_INLINE static constexpr size_t priority_level(priority p) {
+		if (p >= priority::high)
+			return 0;
+		else if (p >= priority::normal)
+			return 1;
+		else
+			return 2;
+	}
+
 	// Task cancellation exception.
 	//
 	struct task_cancelled_exception : std::exception {
@@ -45,6 +69,73 @@ namespace retro::neo {
 		const char* what() const override { return "Task cancelled."; }
 	};
 
+	// Size-class pool backing the task frames, blocks are cached per thread and refilled from a global list.
+	// - Released blocks stay in the releasing thread's cache until its next pool operation, so the caller may still touch them right after,
+	//   the first word of a released block is never written by the pool.
+	//
+	namespace frame_pool {
+		static constexpr u8 unpooled = 0xFF;
+
+		struct statistics {
+			u64 live_frames	 = 0;
+			u64 pool_hits		 = 0;
+			u64 pool_misses	 = 0;
+			u64 bytes_retained = 0;
+		};
+
+		// Size class of a block with the given length or unpooled if too large.
+		//
+		u8 class_of(size_t n);
+
+		// Allocation and release.
+		// - Release fails once the calling thread's cache was torn down as the block could no longer be kept private to it,
+		//   the caller then frees it to the heap itself after it is done touching it.
+		//
+		void* allocate(u8 size_class);
+		bool	deallocate(void* p, u8 size_class);
+
+		// Shrinks the block to n bytes if enough would be released, the block then leaves the pool and is owned by the heap.
+		//
+		bool shrink(void* p, u8 size_class, size_t n);
+
+		// Returns the aggregated statistics across all threads.
+		//
+		statistics stats();
+
+		// Releases the blocks cached globally and by the calling thread back to the heap.
+		//
+		void trim();
+	};
+
+	// Task-local stack arena for the subtask frames, the chunk is taken from the frame pool lazily and released once the task completes.
+	// - Frames released out of order are marked and popped once everything above them is released as well.
+	//
+	struct subtask_arena {
+		static constexpr size_t chunk_size = 16_kb;
+
+		struct frame_header {
+			subtask_arena* arena;
+			u32				prev;
+			u32				freed;
+		};
+
+		u8* base = nullptr;
+		u32 top	= 0;
+		u32 last = UINT32_MAX;
+
+		// Allocates a frame with a header, returns nullptr if the arena is exhausted.
+		//
+		void* allocate(size_t n);
+
+		// Releases a frame allocated from this arena.
+		//
+		void deallocate(frame_header* h);
+
+		// Returns the chunk to the pool, all frames should be released at this point.
+		//
+		void release();
+	};
+
 	// Finally clause.
 	//
 	struct task_state;
@@ -54,10 +145,42 @@ namespace retro::neo {
 		virtual ~finally_clause()									= default;
 	};
 
+	// Cancellation group, tasks queued from within a task join the group of the task queueing them.
+	// - Cancelling a group signals every member so it stops at its next checkpoint and drops the queued ones right away.
+	// - Tasks queued into a cancelled group are cancelled before they get to run.
+	//
+	struct scheduler;
+	struct cancel_group {
+		mutable spinlock	lock			 = {};
+		task_state*			members		 = nullptr;
+		size_t				member_count = 0;
+		std::atomic<bool> cancelled	 = false;
+
+		static ref<cancel_group> create() { return make_rc<cancel_group>(); }
+
+		// Observers.
+		//
+		bool	 is_cancelled() const { return cancelled.load(std::memory_order::relaxed); }
+		size_t size() const {
+			std::lock_guard _g{lock};
+			return member_count;
+		}
+
+		// Cancels every member.
+		//
+		void cancel();
+
+		// Links or unlinks a member, called by the scheduler on insertion and by the task once it settles.
+		//
+		void add(task_state* ts);
+		void remove(task_state* ts);
+	};
+
 	// Task state.
 	//
 	struct task_state {
 		enum class id : u16 { pending, cancelled, success, error };
+		enum class park_id : u8 { running, parking, parked, woken };
 
 		// Internal linked list.
 		//
@@ -69,6 +192,27 @@ namespace retro::neo {
 		timestamp	  slice_end = {};
 		neo::priority prio		= neo::priority::normal;
 
+		// Time the task was last pushed into a run queue.
+		//
+		timestamp queue_time = {};
+
+		// Checkpoint budget and the preemption flag of the worker currently running the task.
+		// - Budget is zeroed by other threads to force the slow path at the next checkpoint.
+		//
+		std::atomic<i32>* volatile tick_budget		= nullptr;
+		volatile bool*					preempt_signal = nullptr;
+		u32								tick_refill		= 1;
+		timestamp						tick_last		= {};
+
+		// Sequence number assigned on insertion, identifies the task in recorded schedules.
+		//
+		u64 seq = 0;
+
+		// Run queue the task is linked into, or UINT32_MAX if not queued, and its level, guarded by the queue lock.
+		//
+		std::atomic<u32> queue_index = UINT32_MAX;
+		u8					  queue_level = 0;
+
 		// First and the last coroutine in the callstack.
 		//
 		coroutine_handle<> coro_promise = {};
@@ -79,6 +223,47 @@ namespace retro::neo {
 		std::atomic<id> state					= id::pending;
 		volatile bool	 cancellation_signal = false;
 
+		// Owning scheduler and the parking state used while awaiting on another promise.
+		//
+		scheduler*				  sched		  = nullptr;
+		std::atomic<park_id> park_state = park_id::running;
+
+		// Promise the task is parked on, or the children of the join it is parked on, used to propagate priority boosts.
+		// - Children are owned by the join awaitable, which clears the span before releasing them.
+		//
+		spinlock							  dep_lock		= {};
+		ref<task_state>				  awaiting		= nullptr;
+		std::span<task_state* const> awaiting_all	= {};
+
+		// Cancellation group and the links within its member list.
+		//
+		ref<cancel_group> group		 = nullptr;
+		task_state*			group_prev = nullptr;
+		task_state*			group_next = nullptr;
+
+		// Size class of the frame pool block holding this state.
+		//
+		u8 pool_class = frame_pool::unpooled;
+
+		// Arena for the subtask frames.
+		//
+		subtask_arena arena = {};
+
+		// Telemetry, only written by the worker running the task.
+		// - Cancel point is the number of checkpoints passed when the cancellation was observed, -1 if it was not.
+		//
+		struct telemetry_data {
+			timestamp enqueue_time	 = {};
+			timestamp first_run_time = {};
+			duration	 run_time		 = {};
+			u32		 slices			 = 0;
+			u32		 checkpoints	 = 0;
+			i32		 cancel_point	 = -1;
+
+			duration queue_latency() const { return slices ? first_run_time - enqueue_time : duration{}; }
+		};
+		telemetry_data telemetry = {};
+
 		// Finally list.
 		//
 		spinlock			 fin_lock = {};
@@ -95,6 +280,8 @@ namespace retro::neo {
 			RC_ASSERT(state == id::pending && s != id::pending);
 			state = s;
 			state.notify_all();
+			if (group)
+				group->remove(this);
 
 			// Lock the finally list and acquire it.
 			//
@@ -129,6 +316,28 @@ namespace retro::neo {
 				task_signal(id::cancelled);
 		}
 
+		// Marks the task as parking, must be followed by a call to task_unpark once the awaited event happens.
+		//
+		void task_park() { park_state.store(park_id::parking, std::memory_order::relaxed); }
+
+		// Wakes a parked task, re-queueing it into its scheduler if the worker already released it.
+		//
+		void task_unpark();
+
+		// Checkpoint fast path, returns false once the budget runs out.
+		//
+		RC_INLINE bool task_tick() {
+			auto* b = tick_budget;
+			i32	n = b->load(std::memory_order::relaxed) - 1;
+			b->store(n, std::memory_order::relaxed);
+			return n > 0;
+		}
+
+		// Checkpoint slow path, refills the budget and checks for cancellation, preemption and the end of the slice.
+		//
+		enum class tick_id : u8 { resume, yield, cancel };
+		tick_id task_checkpoint();
+
 		// Promise implementations.
 		//
 		id promise_wait() const {
@@ -167,15 +376,33 @@ namespace retro::neo {
 		bool promise_success() const { return state == id::success; }
 		bool promise_error() const { return state == id::error; }
 		bool promise_cancel() {
-			cancellation_signal = true;
+			promise_request_cancel();
 			return promise_wait() == id::cancelled;
 		}
+
+		// Signals cancellation without waiting for the task to observe it.
+		//
+		void promise_request_cancel() {
+			cancellation_signal = true;
+			if (auto* b = tick_budget)
+				b->store(0, std::memory_order::relaxed);
+			task_unpark();
+		}
+
+		// Changes the priority of a pending task, moving it to the matching run queue level if queued.
+		// - Raising the priority is propagated to the tasks being awaited on, boost only ever raises.
+		//
+		void promise_set_priority(neo::priority p);
+		void promise_boost(neo::priority p) {
+			if (prio < p && state == id::pending)
+				promise_set_priority(p);
+		}
 		void promise_add_finally(finally_clause* f) {
 			std::unique_lock flock{fin_lock};
 
 			// If already executed, do not insert anything into the list.
 			//
-			if (auto st = state.load(std::memory_order::relaxed); st > id::cancelled) [[unlikely]] {
+			if (auto st = state.load(std::memory_order::relaxed); st != id::pending) [[unlikely]] {
 				flock.unlock();
 				f->on_finally(this, st == id::success);
 				delete f;
@@ -202,8 +429,22 @@ namespace retro::neo {
 		static void* alloc_coro(size_t coro_size) {
 			constexpr size_t state_size = size_of<T>();
 
-			auto ts	= make_overalloc_rc<task_state>(state_size - sizeof(task_state) + coro_size).release();
-			auto hnd = coroutine_handle<>::from_address(((u8*) ts) + state_size);
+			// Pooled blocks carry an extra weak reference on behalf of the pool so the ref-counter never releases them to the heap.
+			//
+			u8			  size_class = frame_pool::class_of(sizeof(rc_header) + state_size + coro_size);
+			rc_header* rc;
+			if (size_class != frame_pool::unpooled) [[likely]] {
+				rc = new (frame_pool::allocate(size_class)) rc_header();
+				rc->inc_ref_weak();
+				rc->dtor = &release_pooled;
+			} else {
+				rc		  = new (heap::allocate(sizeof(rc_header) + state_size + coro_size)) rc_header();
+				rc->dtor = &release_unpooled;
+			}
+
+			auto ts			= new (rc->data()) task_state();
+			ts->pool_class = size_class;
+			auto hnd			= coroutine_handle<>::from_address(((u8*) ts) + state_size);
 
 			ts->coro_promise = hnd;
 			ts->coro_current = hnd;
@@ -221,11 +462,34 @@ namespace retro::neo {
 		static void delete_coro(void* coro_address) {
 			auto ts	= from_coro<T>(coroutine_handle<>::from_address(coro_address));
 			ts->coro_promise = nullptr;
+			ts->arena.release();
 
+			// Release the coroutine frame if the state outlives it, pooled blocks leave the pool if large enough to matter.
+			//
 			auto rc = rc_header::from(ts);
-			heap::shrink(rc, size_of<T>() + sizeof(rc_header));
+			if (ts->pool_class == frame_pool::unpooled) {
+				heap::shrink(rc, size_of<T>() + sizeof(rc_header));
+			} else if ((rc->ref_counter.load(std::memory_order::relaxed) & bit_mask(32)) != 1) {
+				if (frame_pool::shrink(rc, ts->pool_class, size_of<T>() + sizeof(rc_header))) {
+					ts->pool_class = frame_pool::unpooled;
+					rc->dtor			= &release_unpooled;
+					rc->dec_ref_weak();
+				}
+			}
 			rc->dec_ref();
 		}
+		static void release_unpooled(rc_header* rc) { std::destroy_at((task_state*) rc->data()); }
+		static void release_pooled(rc_header* rc) {
+			auto ts	= (task_state*) rc->data();
+			u8	  cls = ts->pool_class;
+			std::destroy_at(ts);
+
+			// The caller still decrements the counter of the block after this, if the pool cannot hold onto it until then,
+			// drop its weak reference so that the heap frees it once that is done instead.
+			//
+			if (!frame_pool::deallocate(rc, cls))
+				rc->dec_ref_weak();
+		}
 
 		// Invoke dtor on destruction.
 		//
@@ -236,50 +500,219 @@ namespace retro::neo {
 		}
 	};
 
+	// Scheduling modes.
+	//
+	enum class schedule_mode : u8 {
+		shared_fifo,	 // Single queue shared by all workers, strict FIFO.
+		work_stealing,	 // Per-worker deques, LIFO local execution and randomized stealing.
+		deterministic,	 // Single worker, virtual clock and checkpoint counted slices, optionally seeded and recorded for replay.
+	};
+
+	// Worker placement policies, applied over the CPUs allowed by the affinity mask.
+	//
+	enum class pin_policy : u8 {
+		none,		 // Workers float over the affinity mask.
+		compact,	 // One CPU per worker in topology order, filling each node before moving to the next.
+		scatter,	 // One CPU per worker, round-robin across the nodes and distinct cores before SMT siblings.
+		per_node, // Round-robin across the nodes, each worker may run on any CPU of its node.
+	};
+
+	// Scheduler statistics, histograms are indexed by the base 2 logarithm of the duration in microseconds.
+	//
+	struct scheduler_statistics {
+		static constexpr size_t histogram_size = 24;
+
+		u64										 tasks_started				= 0;
+		u64										 tasks_finished			= 0;
+		u64										 tasks_cancelled			= 0;
+		u64										 slices						= 0;
+		u64										 checkpoints				= 0;
+		duration									 queue_latency				= {};
+		duration									 run_time					= {};
+		std::array<u64, histogram_size> queue_latency_histogram = {};
+		std::array<u64, histogram_size> run_time_histogram		= {};
+
+		static size_t histogram_index(duration d) {
+			auto us = chrono::duration_cast<chrono::microseconds>(d).count();
+			return std::min<size_t>(std::bit_width(u64(std::max<i64>(us, 0))), histogram_size - 1);
+		}
+		scheduler_statistics& operator+=(const scheduler_statistics& o);
+	};
+
 	// Scheduler instance.
 	//
 	struct scheduler : pinned {
 	  private:
+		// Run queue, one per worker in work-stealing mode, single shared instance otherwise.
+		// - Owner pushes and pops from the back, thieves and rescheduled tasks use the front.
+		// - Size is only changed under the lock but can be read without it, to skip the empty queues when stealing.
+		//
+		struct run_queue : pinned {
+			spinlock					  lock								= {};
+			list::head<task_state> levels[num_priority_levels]	= {};
+			std::atomic<size_t>	  size								= 0;
+
+			bool empty() const { return size.load(std::memory_order::relaxed) == 0; }
+		};
+
+		// Per-worker state, statistics are only written by the owning worker and read racily.
+		//
+		struct alignas(64) worker_state {
+			scheduler_statistics stats			= {};
+			std::atomic<i32>		tick_budget	= 0;
+			volatile bool			preempt		= false;
+			std::atomic<u8>		running_level = num_priority_levels;
+
+			// NUMA node the worker is placed on, and whether it is out of work (or not running at all).
+			//
+			std::atomic<u32>	node = 0;
+			std::atomic<bool> idle = true;
+
+			// Thread handle and whether it is running, guarded by the thread lock.
+			//
+			std::thread thread = {};
+			bool			alive	 = false;
+		};
+
 		// Internals.
 		//
-		std::counting_semaphore<> signal{0};
-		std::vector<std::thread>  thread_list			  = {};
-		spinlock						  lock					  = {};
-		std::atomic<u32>			  suspended				  = false;
-		volatile bool				  termination_signal	  = false;
-		list::head<task_state>	  queue					  = {};
-		std::atomic<u64>			  remaining_task_count = 0;
-		volatile u64				  affinity_mask		  = platform::g_affinity_mask;
-
-		// Pushes a task for rescheduling.
-		void push(task_state* w);
-		// Pops a task promise for execution.
-		task_state* pop();
+		std::counting_semaphore<>	  signal{0};
+		std::unique_ptr<run_queue[]> queue_list			 = {};
+		size_t							  queue_count			 = 0;
+		std::unique_ptr<worker_state[]> worker_list = {};
+		size_t							  worker_capacity		 = 0;
+		umutex							  thread_lock			 = {};
+		std::atomic<u32>				  thread_target		 = 0;
+		std::atomic<u32>				  live_count			 = 0;
+		std::atomic<duration>		  spin_duration		 = duration{50us};
+		std::atomic<duration>		  idle_timeout			 = duration{10s};
+		std::atomic<u32>				  urgent_count		 = 0;
+		std::atomic<u64>				  next_seq				 = 0;
+		std::atomic<u64>				  cleared_count		 = 0;
+		schedule_mode					  mode					 = schedule_mode::work_stealing;
+		std::atomic<u32>				  suspended				 = false;
+		volatile bool					  termination_signal	 = false;
+		std::atomic<u32>				  idle_count			 = 0;
+		std::atomic<u32>				  inject_counter		 = 0;
+		std::atomic<u64>				  remaining_task_count = 0;
+		volatile u64					  affinity_mask		 = platform::g_affinity_mask;
+		std::atomic<u32>				  placement_epoch		 = 0;
+		volatile pin_policy			  pin						 = pin_policy::none;
+		volatile bool					  node_local_steal	 = false;
+
+		// Deterministic mode state, the virtual clock advances by one slice per pop.
+		//
+		std::atomic<u64> virtual_slices	= 0;
+		u64				  rng_seed			= 0;
+		mutable spinlock trace_lock		= {};
+		bool				  recording			= false;
+		std::vector<u64> trace				= {};
+		std::vector<u64> replay_trace		= {};
+		size_t			  replay_cursor	= 0;
+		bool				  replay_diverged	= false;
+
+		// Pushes a task for execution, if reschedule is set, places it behind every other local task.
+		void push(task_state* w, bool reschedule = false);
+		// Task state needs to push on wake-up.
+		friend struct task_state;
+
+		// Moves a queued task to the level matching its current priority.
+		void requeue(task_state* ts);
+
+		// Pops a task promise for execution, starting with the local queue and then stealing.
+		task_state* pop(size_t worker_index);
+		// Pops the next task in deterministic mode, following the replayed schedule if any.
+		task_state* pop_deterministic();
+		// Clock used for queue times and aging, virtual in deterministic mode.
+		timestamp clock() const;
+		// Unlinks a task from its locked queue.
+		void unlink_queued(run_queue& q, task_state* ts);
+		// Takes the next task from a locked queue, considering levels up to max_level.
+		task_state* take(run_queue& q, bool lifo, timestamp t, size_t max_level = num_priority_levels - 1);
+		// Steals from the front of the other queues, starting at a random victim.
+		task_state* steal(size_t local, timestamp t, size_t max_level = num_priority_levels - 1);
+		// Asks a worker running a task below the given level to yield at its next checkpoint.
+		void preempt(size_t level);
+		// Wakes up to n workers if there are any parked, spawning new ones if below the target.
+		void wake(size_t n = 1);
+		// Spawns up to n workers in the free slots below the target.
+		void grow(size_t n);
+		// Retires the worker unless there is queued work left to pick up, returns true if the thread should exit.
+		bool retire(size_t worker_index, bool force);
+		// Returns true if any of the queues has a task.
+		bool has_queued() const;
+		// Number of queues external pushes are distributed to.
+		size_t num_active_queues() const { return std::min<size_t>(queue_count, std::max<u32>(thread_target.load(std::memory_order::relaxed), 1)); }
+		// Computes the CPUs a worker should be pinned to and its node, empty if it should use the affinity mask as is.
+		std::vector<u32> placement_of(size_t worker_index, u32& node) const;
 		// Worker thread entry point.
-		static void thread_main(scheduler* schd);
+		static void thread_main(scheduler* schd, size_t worker_index);
 
 	  public:
 		// Default scheduler.
 		//
 		static scheduler default_instance;
 
-		// Constructs a scheduler with the given number of threads.
+		// Scheduler of the calling worker thread, the default one if not called from a worker.
+		//
+		static scheduler& current();
+
+		// Constructs a scheduler with the given number of threads, the pool can later be resized up to the capacity.
+		//
+		scheduler(size_t n = 0, schedule_mode mode = schedule_mode::work_stealing, size_t capacity = 0);
+
+		// Deterministic mode controls.
+		// - Non-zero seed picks randomly among the tasks of the highest queued level instead of the deadline order.
+		// - Recording stores the sequence number of the task run in each slice, replay follows such a schedule and waits for
+		//   the next task in it to be queued, falling back to the regular order once it is exhausted.
+		// - If other tasks are queued while the next one is not, the run diverged from the schedule, the rest of it is dropped and
+		//   the divergence is flagged until the next replay.
+		//
+		void				  set_seed(u64 seed);
+		void				  record_schedule(bool enable);
+		std::vector<u64> get_schedule() const;
+		void				  replay_schedule(std::vector<u64> schedule);
+		bool				  has_replay_diverged() const;
+
+		// Changes the number of worker threads, clamped to [1, capacity], extra workers retire after their current task.
 		//
-		scheduler(size_t n = 0);
+		void set_thread_count(size_t n);
+
+		// Idle workers spin for the given duration before parking and exit once parked for longer than the reclaim timeout.
+		// - Zero reclaim timeout keeps the idle workers alive, reclaimed workers are respawned on demand.
+		//
+		void set_idle_policy(duration spin, duration reclaim) {
+			spin_duration.store(spin, std::memory_order::relaxed);
+			idle_timeout.store(reclaim, std::memory_order::relaxed);
+		}
 
 		// Sets scheduler affinity.
 		//
 		void update_affinity(u64 affinity = platform::g_affinity_mask) {
 			affinity_mask = affinity;
+			placement_epoch.fetch_add(1, std::memory_order::release);
+		}
+
+		// Sets the worker placement policy, if node local stealing is set, workers only steal from the queues of
+		// other nodes when their owner is out of work, keeping tasks on the node that spawned them.
+		//
+		void set_placement(pin_policy p, bool node_local = false) {
+			pin				  = p;
+			node_local_steal = node_local;
+			placement_epoch.fetch_add(1, std::memory_order::release);
 		}
 
 		// Schedules a task.
 		//
 		void insert(task_state* ts, priority prio = priority::normal);
 
-		// Cancels all tasks.
+		// Schedules a batch of tasks, linking them under a single lock acquisition per queue and waking the workers at once.
+		//
+		void insert_many(std::span<task_state* const> list, priority prio = priority::normal);
+
+		// Cancels all queued tasks, or only those of the given group.
 		//
-		void clear();
+		void clear(const cancel_group* group = nullptr);
 
 		// Waits until all tasks in the scheduler are completed.
 		//
@@ -300,8 +733,18 @@ namespace retro::neo {
 
 		// Observers.
 		//
-		u64  num_remaining_tasks() const { return remaining_task_count.load(std::memory_order::relaxed); }
-		bool is_suspended() const { return suspended.load(std::memory_order::relaxed) != 0; }
+		u64			  num_remaining_tasks() const { return remaining_task_count.load(std::memory_order::relaxed); }
+		bool			  is_suspended() const { return suspended.load(std::memory_order::relaxed) != 0; }
+		size_t		  num_threads() const { return live_count.load(std::memory_order::relaxed); }
+		size_t		  thread_count() const { return thread_target.load(std::memory_order::relaxed); }
+		size_t		  thread_capacity() const { return worker_capacity; }
+		schedule_mode get_mode() const { return mode; }
+		pin_policy	  get_pin_policy() const { return pin; }
+		bool			  is_node_local() const { return node_local_steal; }
+
+		// Aggregates the statistics of all workers.
+		//
+		scheduler_statistics get_statistics() const;
 
 		// Handle cancellation of leftover tasks and thread deletion on destruction.
 		//
@@ -327,6 +770,11 @@ namespace retro::neo {
 
 		task_state* get_task_state() const { return owner; }
 
+		// Frames are allocated from the arena of the task running on this thread, falling back to the heap.
+		//
+		static void* operator new(size_t n);
+		static void	 operator delete(void* p);
+
 		RC_INLINE inline suspend_always					 initial_suspend() noexcept { return {}; }
 		RC_INLINE inline symmetric_transfer_awaitable final_suspend() noexcept { return {continuation}; }
 		RC_INLINE inline void unhandled_exception() { pending_exception = std::current_exception(); }
@@ -412,19 +860,19 @@ namespace retro::neo {
 		RC_INLINE inline coroutine_handle<> await_suspend(coroutine_handle<T> hnd) {
 			auto*			chain = &hnd.promise();
 			task_state* o		= chain->get_task_state();
-			if (!o)
+			if (!o || o->task_tick()) [[likely]]
 				return hnd;
 
-			if (o->cancellation_signal) [[unlikely]] {
-				o->task_cancel();
-				o->coro_current = hnd;
-				return noop_coroutine();
+			switch (o->task_checkpoint()) {
+				case task_state::tick_id::cancel:
+					o->task_cancel();
+					[[fallthrough]];
+				case task_state::tick_id::yield:
+					o->coro_current = hnd;
+					return noop_coroutine();
+				default:
+					return hnd;
 			}
-			if (o->slice_end < now()) {
-				o->coro_current = hnd;
-				return noop_coroutine();
-			}
-			return hnd;
 		}
 		RC_INLINE inline void await_resume() {}
 	};
@@ -496,6 +944,15 @@ namespace retro::neo {
 			return new store(std::forward<F>(fn));
 		}
 
+		static finally_clause* make_unpark(task_state* waiter) {
+			struct store final : finally_clause {
+				ref<task_state> waiter;
+				store(task_state* w) : waiter(w) {}
+				void on_finally(task_state*, bool) override { waiter->task_unpark(); }
+			};
+			return new store(waiter);
+		}
+
 		template<typename F, typename R, typename... A>
 		static R coro_wrapper(F fn, A... args)
 #ifdef __INTELLISENSE__
@@ -512,6 +969,50 @@ namespace retro::neo {
 #endif
 	};
 
+	// Awaitable for promises, parks the task awaiting it until the promise settles.
+	// - If not awaited from within a task, blocks until completion instead.
+	//
+	template<typename Ty>
+	struct promise_awaitable {
+		task_state* state;
+		task_state* owner = nullptr;
+
+		RC_INLINE inline bool await_ready() const { return !state->promise_pending(); }
+
+		template<typename T>
+		RC_INLINE inline coroutine_handle<> await_suspend(coroutine_handle<T> hnd) {
+			auto*			chain = &hnd.promise();
+			task_state* o		= chain->get_task_state();
+			if (!o) {
+				state->promise_wait();
+				return hnd;
+			}
+
+			// Record the dependency and lend it our priority.
+			//
+			owner = o;
+			{
+				std::lock_guard _g{o->dep_lock};
+				o->awaiting = state;
+			}
+			state->promise_boost(o->prio);
+
+			// Park the task and register the wake-up.
+			//
+			o->coro_current = hnd;
+			o->task_park();
+			state->promise_add_finally(detail::make_unpark(o));
+			return noop_coroutine();
+		}
+		RC_INLINE inline decltype(auto) await_resume() const {
+			if (owner) {
+				std::lock_guard _g{owner->dep_lock};
+				owner->awaiting = nullptr;
+			}
+			return state->template promise_get<Ty>();
+		}
+	};
+
 	// Promise type.
 	//
 	template<typename Ty>
@@ -553,6 +1054,15 @@ namespace retro::neo {
 		//
 		bool cancel() const { return state->promise_cancel(); }
 
+		// Changes the priority of the task, boost only raises it, both propagate raises to the awaited promise or join children.
+		//
+		void set_priority(neo::priority p) const { state->promise_set_priority(p); }
+		void boost(neo::priority p) const { state->promise_boost(p); }
+
+		// Awaits the result from within a task without blocking the worker.
+		//
+		promise_awaitable<Ty> operator co_await() const { return {state.get()}; }
+
 		// Adds a then callback in the form of void(Ty).
 		//
 		template<typename F>
@@ -600,6 +1110,14 @@ namespace retro::neo {
 			return promise;
 		}
 
+		// Sets the cancellation group the task joins once queued, instead of the one of the task queueing it.
+		//
+		task in_group(ref<cancel_group> g) && {
+			if (handle)
+				handle.promise().get_task_state()->group = std::move(g);
+			return std::move(*this);
+		}
+
 		// Queues a task and discards the promise.
 		//
 		void detach(scheduler& sched = scheduler::default_instance, priority prio = priority::normal) {
@@ -615,6 +1133,225 @@ namespace retro::neo {
 		task& operator=(task&&) noexcept = default;
 	};
 
+	// Queues a batch of tasks in a single scheduler insertion and returns the associated promises.
+	//
+	template<typename Ty>
+	[[nodiscard]] static std::vector<promise<Ty>> queue_batch(std::span<task<Ty>> tasks, scheduler& sched = scheduler::default_instance, priority prio = priority::normal) {
+		std::vector<promise<Ty>> promises = {};
+		std::vector<task_state*> states	 = {};
+		promises.reserve(tasks.size());
+		states.reserve(tasks.size());
+		for (auto& t : tasks) {
+			if (!t.handle) [[unlikely]] {
+				promises.emplace_back();
+				continue;
+			}
+			auto* ts = t.handle.release().promise().get_task_state();
+			promises.emplace_back(ts);
+			states.emplace_back(ts);
+		}
+		sched.insert_many(states, prio);
+		return promises;
+	}
+
+	// Fork-join helpers.
+	//
+	namespace detail {
+		// Join state shared between the children and the awaiting task, the last child to settle (or the first one if racing) wakes the waiter.
+		//
+		struct join_state {
+			std::atomic<size_t> remaining = 0;
+			std::atomic<size_t> winner		= SIZE_MAX;
+			std::atomic<u32>	  signal		= 0;
+			ref<task_state>	  waiter		= nullptr;
+
+			void wake() {
+				if (waiter) {
+					waiter->task_unpark();
+				} else {
+					signal.store(1, std::memory_order::release);
+					signal.notify_all();
+				}
+			}
+		};
+		static finally_clause* make_join(ref<join_state> j, size_t index, bool race) {
+			struct store final : finally_clause {
+				ref<join_state> j;
+				size_t			 index;
+				bool				 race;
+				store(ref<join_state> j, size_t index, bool race) : j(std::move(j)), index(index), race(race) {}
+				void on_finally(task_state*, bool) override {
+					if (race) {
+						size_t expected = SIZE_MAX;
+						if (j->winner.compare_exchange_strong(expected, index, std::memory_order::acq_rel))
+							j->wake();
+					} else if (j->remaining.fetch_sub(1, std::memory_order::acq_rel) == 1) {
+						j->wake();
+					}
+				}
+			};
+			return new store(std::move(j), index, race);
+		}
+
+		// Awaitable base spawning the children into the scheduler of the awaiting task with its priority.
+		// - If not awaited from within a task, queues them into the default scheduler and blocks instead.
+		// - Children that have not settled by the time the awaitable is destroyed are cancelled, which
+		//   covers both the losers of a race and the parent getting cancelled while parked.
+		//
+		template<typename Ty>
+		struct fork_join_awaitable {
+			std::vector<task<Ty>>	 tasks;
+			std::vector<promise<Ty>> children		  = {};
+			std::vector<task_state*> children_states = {};
+			ref<join_state>			 join				  = nullptr;
+			task_state*					 owner			  = nullptr;
+			bool							 race				  = false;
+
+			fork_join_awaitable(std::vector<task<Ty>> tasks, bool race) : tasks(std::move(tasks)), race(race) {}
+			fork_join_awaitable(fork_join_awaitable&&) noexcept = default;
+			~fork_join_awaitable() {
+				if (owner) {
+					std::lock_guard _g{owner->dep_lock};
+					owner->awaiting_all = {};
+				}
+				for (auto& c : children)
+					if (c && c.pending())
+						c.state->promise_request_cancel();
+			}
+
+			RC_INLINE inline bool await_ready() const { return tasks.empty(); }
+
+			template<typename T>
+			coroutine_handle<> await_suspend(coroutine_handle<T> hnd) {
+				auto*			chain = &hnd.promise();
+				task_state* o		= chain->get_task_state();
+
+				// Create the children and register the joins before any of them can run.
+				//
+				join = make_rc<join_state>();
+				join->remaining.store(tasks.size(), std::memory_order::relaxed);
+				join->waiter = o;
+				children.reserve(tasks.size());
+				std::vector<task_state*> states = {};
+				states.reserve(tasks.size());
+				for (size_t i = 0; i != tasks.size(); i++) {
+					auto* ts = tasks[i].handle.release().promise().get_task_state();
+					children.emplace_back(ts);
+					states.emplace_back(ts);
+					ts->promise_add_finally(make_join(join, i, race));
+				}
+				tasks.clear();
+
+				// If not within a task, block until the join completes.
+				//
+				if (!o) {
+					scheduler::default_instance.insert_many(states, priority::normal);
+					while (!join->signal.load(std::memory_order::acquire))
+						join->signal.wait(0);
+					return hnd;
+				}
+
+				// Record the children as dependencies so that boosts reach them, then park the task and spawn them.
+				//
+				owner				 = o;
+				children_states = std::move(states);
+				{
+					std::lock_guard _g{o->dep_lock};
+					o->awaiting_all = children_states;
+				}
+				o->coro_current = hnd;
+				o->task_park();
+				o->sched->insert_many(children_states, o->prio);
+				return noop_coroutine();
+			}
+		};
+	};
+
+	// Awaitable joining all children, returns the results in order and rethrows the first error.
+	//
+	template<typename Ty>
+	struct when_all_awaitable : detail::fork_join_awaitable<Ty> {
+		when_all_awaitable(std::vector<task<Ty>> tasks) : detail::fork_join_awaitable<Ty>(std::move(tasks), false) {}
+
+		auto await_resume() const {
+			if constexpr (std::is_void_v<Ty>) {
+				for (auto& c : this->children)
+					c.get();
+			} else {
+				std::vector<Ty> result = {};
+				result.reserve(this->children.size());
+				for (auto& c : this->children)
+					result.emplace_back(c.get());
+				return result;
+			}
+		}
+	};
+
+	// Awaitable racing the children, returns the index of the first one to settle (and its result), cancels the rest.
+	//
+	template<typename Ty>
+	struct when_any_awaitable : detail::fork_join_awaitable<Ty> {
+		when_any_awaitable(std::vector<task<Ty>> tasks) : detail::fork_join_awaitable<Ty>(std::move(tasks), true) { RC_ASSERT(!this->tasks.empty()); }
+
+		auto await_resume() const {
+			size_t idx = this->join->winner.load(std::memory_order::acquire);
+			for (size_t i = 0; i != this->children.size(); i++)
+				if (i != idx && this->children[i].pending())
+					this->children[i].state->promise_request_cancel();
+			if constexpr (std::is_void_v<Ty>) {
+				this->children[idx].get();
+				return idx;
+			} else {
+				return std::pair<size_t, Ty>{idx, this->children[idx].get()};
+			}
+		}
+	};
+
+	// Fork-join combinators, children are queued into the scheduler of the awaiting task once awaited.
+	//
+	template<typename Ty>
+	[[nodiscard]] static when_all_awaitable<Ty> when_all(std::vector<task<Ty>> tasks) {
+		return {std::move(tasks)};
+	}
+	template<typename Ty>
+	[[nodiscard]] static when_any_awaitable<Ty> when_any(std::vector<task<Ty>> tasks) {
+		return {std::move(tasks)};
+	}
+
+	// Chunked parallel for, runs fn(i) for each index in [begin, end) with chunks of the given size as child tasks.
+	// - If chunk is zero, picks one that splits the range into a few chunks per hardware thread.
+	//
+	namespace detail {
+		template<typename F>
+		static task<void> for_chunk(F fn, size_t begin, size_t end)
+#ifdef __INTELLISENSE__
+			 ;
+#else
+		{
+			for (size_t i = begin; i != end; i++) {
+				fn(i);
+				co_await checkpoint{};
+			}
+		}
+#endif
+	};
+	template<typename F>
+	[[nodiscard]] static when_all_awaitable<void> parallel_for(size_t begin, size_t end, size_t chunk, F&& fn) {
+		if (begin >= end)
+			return {{}};
+		if (!chunk)
+			chunk = std::max<size_t>(1, (end - begin) / (4 * std::max<size_t>(1, std::thread::hardware_concurrency())));
+
+		std::vector<task<void>> tasks = {};
+		tasks.reserve((end - begin + chunk - 1) / chunk);
+		for (size_t i = begin; i != end;) {
+			size_t n = std::min(chunk, end - i);
+			tasks.emplace_back(detail::for_chunk<std::decay_t<F>>(fn, i, i + n));
+			i += n;
+		}
+		return {std::move(tasks)};
+	}
+
 	// Creates an async task given a lambda.
 	//
 	template<typename F, typename... A>
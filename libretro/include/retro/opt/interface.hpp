@@ -1,5 +1,6 @@
 #pragma once
 #include <retro/common.hpp>
+#include <retro/func.hpp>
 #include <retro/ir/basic_block.hpp>
 #include <retro/ir/routine.hpp>
 
@@ -31,4 +32,15 @@ namespace retro::ir::opt {
 	// Conversion of load_mem with constant address.
 	//
 	size_t const_load(basic_block* bb);
+
+	// Reads the value a load_mem instruction would produce from the given address if it maps to constant memory.
+	//
+	constant load_const_value(const insn* ins, u64 adr);
+
+	// Evaluates an operand into a constant without modifying the IR, returns an empty constant if it is not one.
+	// - Follows binop/unop/cmp/select/casts, constant loads and local register writes up to the given depth.
+	//
+	constant const_eval(const operand& op, size_t max_depth = 32);
+	// - The substitution callback is consulted first for every instruction visited, a non-empty result replaces its value.
+	constant const_eval(const operand& op, function_view<constant(const insn*)> subst, size_t max_depth = 32);
 };
\ No newline at end of file
@@ -0,0 +1,67 @@
+#pragma once
+#include <retro/common.hpp>
+#include <retro/diag.hpp>
+#include <retro/neo.hpp>
+#include <retro/rc.hpp>
+#include <retro/ir/basic_block.hpp>
+#include <retro/ir/routine.hpp>
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace retro::ir::opt {
+	// Optimization pass.
+	// - Either block or routine level, statistics are updated as pipelines run it.
+	//
+	struct pass {
+		std::string name								= {};
+		size_t (*block_fn)(basic_block*)		= nullptr;
+		size_t (*routine_fn)(routine*)		= nullptr;
+
+		// Statistics.
+		//
+		std::atomic<u64> runs		 = 0;
+		std::atomic<u64> changes	 = 0;
+		std::atomic<u64> time_ns	 = 0;
+
+		// Runs the pass and records the statistics.
+		//
+		size_t operator()(basic_block* bb);
+		size_t operator()(routine* rtn);
+
+		bool is_block_pass() const { return block_fn != nullptr; }
+	};
+
+	// Named pipeline of passes.
+	// - Ran repeatedly until no pass changes anything or the iteration cap is hit.
+	// - Consecutive block passes form a stage that runs on every block before the next pass.
+	//
+	struct pipeline {
+		std::string			  name			  = {};
+		std::vector<pass*> passes		  = {};
+		u32					  max_iterations = 1;
+	};
+
+	// Pass registry, passes are never removed.
+	//
+	pass*					  register_pass(std::string_view name, size_t (*fn)(basic_block*));
+	pass*					  register_pass(std::string_view name, size_t (*fn)(routine*));
+	pass*					  find_pass(std::string_view name);
+	std::vector<pass*> get_passes();
+
+	// Pipeline registry, pipelines are replaced as a whole so that running ones are not affected.
+	// - "init" is the default pipeline applied after lifting.
+	//
+	diag::lazy					 set_pipeline(std::string_view name, const std::vector<std::string>& passes, u32 max_iterations = 1);
+	ref<const pipeline>		 get_pipeline(std::string_view name);
+	std::vector<std::string> get_pipelines();
+
+	// Runs a pipeline on a single block, ignoring routine passes, returns the number of changes.
+	//
+	size_t run_pipeline(const pipeline& pl, basic_block* bb);
+
+	// Runs a pipeline on a routine, returns the number of changes.
+	//
+	neo::subtask<size_t> run_pipeline(ref<const pipeline> pl, ref<routine> rtn);
+};
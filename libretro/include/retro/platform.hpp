@@ -52,6 +52,26 @@ namespace retro::platform {
 	//
 	void set_affinity(u64 mask);
 
+	// Applies an affinity given as a list of CPU indices, allows going past the first 64 CPUs.
+	//
+	void set_affinity(std::span<const u32> cpus);
+
+	// CPU topology, discovered from /sys on Linux and assumed to be a single node elsewhere.
+	// - CPUs are sorted in compact order, by node, package and core so that SMT siblings are adjacent.
+	//
+	struct cpu_info {
+		u32 id		= 0;	// Logical CPU index.
+		u32 node		= 0;	// NUMA node.
+		u32 package = 0;	// Physical package.
+		u32 core		= 0;	// Core identifier within the package.
+		u32 smt		= 0;	// Index among the SMT siblings of the core.
+	};
+	struct cpu_topology {
+		std::vector<cpu_info> cpus		= {};
+		u32						 num_nodes = 1;
+	};
+	const cpu_topology& get_topology();
+
 	// Invoked to ensure ANSI escapes work.
 	//
 	void setup_ansi_escapes();
@@ -186,6 +186,61 @@ namespace retro::arch {
 		return status;
 	}
 
+	// Machine code details.
+	//
+	minsn_flow x86arch::get_flow(const minsn& ins) {
+		switch (ZydisMnemonic(ins.mnemonic)) {
+			case ZYDIS_MNEMONIC_JZ:
+			case ZYDIS_MNEMONIC_JNZ:
+			case ZYDIS_MNEMONIC_JS:
+			case ZYDIS_MNEMONIC_JNS:
+			case ZYDIS_MNEMONIC_JB:
+			case ZYDIS_MNEMONIC_JNB:
+			case ZYDIS_MNEMONIC_JBE:
+			case ZYDIS_MNEMONIC_JNBE:
+			case ZYDIS_MNEMONIC_JL:
+			case ZYDIS_MNEMONIC_JNL:
+			case ZYDIS_MNEMONIC_JLE:
+			case ZYDIS_MNEMONIC_JNLE:
+			case ZYDIS_MNEMONIC_JO:
+			case ZYDIS_MNEMONIC_JNO:
+			case ZYDIS_MNEMONIC_JP:
+			case ZYDIS_MNEMONIC_JNP:
+			case ZYDIS_MNEMONIC_JCXZ:
+			case ZYDIS_MNEMONIC_JECXZ:
+			case ZYDIS_MNEMONIC_JRCXZ:
+			case ZYDIS_MNEMONIC_LOOP:
+			case ZYDIS_MNEMONIC_LOOPE:
+			case ZYDIS_MNEMONIC_LOOPNE:
+				return minsn_flow::branch;
+			case ZYDIS_MNEMONIC_JMP:
+				return minsn_flow::jump;
+			case ZYDIS_MNEMONIC_CALL:
+				return minsn_flow::call;
+			case ZYDIS_MNEMONIC_RET:
+			case ZYDIS_MNEMONIC_IRET:
+			case ZYDIS_MNEMONIC_IRETD:
+			case ZYDIS_MNEMONIC_IRETQ:
+			case ZYDIS_MNEMONIC_SYSRET:
+			case ZYDIS_MNEMONIC_SYSEXIT:
+			case ZYDIS_MNEMONIC_HLT:
+			case ZYDIS_MNEMONIC_UD0:
+			case ZYDIS_MNEMONIC_UD1:
+			case ZYDIS_MNEMONIC_UD2:
+			case ZYDIS_MNEMONIC_INT1:
+			case ZYDIS_MNEMONIC_INT3:
+			case ZYDIS_MNEMONIC_INT:
+				return minsn_flow::stop;
+			default:
+				return minsn_flow::next;
+		}
+	}
+	std::optional<u64> x86arch::resolve_ip_relative(const minsn& ins, const mem& m, u64 ip) {
+		if (m.base == x86::reg::rip && !m.index)
+			return ip + ins.length + m.disp;
+		return std::nullopt;
+	}
+
 	// Formatting.
 	//
 	std::string x86insn::to_string(u64 ip) const {
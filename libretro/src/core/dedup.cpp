@@ -0,0 +1,382 @@
+#include <retro/core/method.hpp>
+#include <retro/core/image.hpp>
+#include <retro/ir/basic_block.hpp>
+#include <retro/ir/routine.hpp>
+#include <retro/ir/insn.hpp>
+#include <retro/hash.hpp>
+#include <mutex>
+#include <shared_mutex>
+
+namespace retro::core {
+	// Maximum number of instructions walked to fingerprint a method.
+	//
+	static constexpr size_t max_fingerprint_insns = 4096;
+
+	// Checks whether a relocation starts within the instruction.
+	//
+	static bool has_reloc(const image* img, u64 rva, u64 length) {
+		auto it = std::lower_bound(img->relocs.begin(), img->relocs.end(), rva, [](auto& a, auto& b) { return a.rva < b; });
+		return it != img->relocs.end() && it->rva < (rva + length);
+	}
+
+	// Gets the value of an operand as an absolute address if it depends on the position of the code.
+	// - Relative immediates and instruction pointer relative memory operands always do, absolute ones only if relocated.
+	//
+	static std::optional<u64> get_position_dependent(arch::handle arch, const arch::minsn& ins, const arch::mop& op, u64 ip, bool relocated) {
+		switch (op.type) {
+			case arch::mop_type::imm:
+				if (op.i.is_relative)
+					return op.i.get_unsigned(ip);
+				if (relocated)
+					return op.i.u;
+				return std::nullopt;
+			case arch::mop_type::mem:
+				if (auto adr = arch->resolve_ip_relative(ins, op.m, ip))
+					return adr;
+				if (relocated && !op.m.base && !op.m.index)
+					return u64(op.m.disp);
+				return std::nullopt;
+			default:
+				return std::nullopt;
+		}
+	}
+
+	// Converts an instruction into a list of tokens, position dependent values are replaced by the result of the mapping.
+	//
+	static void tokenize(arch::handle arch, const arch::minsn& ins, u64 ip, bool relocated, function_view<u64(u64)> map, std::vector<u64>& out) {
+		out.emplace_back(u64(ins.mnemonic) | (u64(ins.length) << 32) | (u64(ins.operand_count) << 40) | (u64(ins.is_supervisor) << 44));
+		out.emplace_back(ins.modifiers);
+		out.emplace_back(ins.effective_width);
+		for (auto& op : ins.operands()) {
+			auto pd = get_position_dependent(arch, ins, op, ip, relocated);
+			switch (op.type) {
+				case arch::mop_type::reg:
+					out.emplace_back(op.r.uid());
+					break;
+				case arch::mop_type::mem:
+					out.emplace_back(u64(op.m.width) | (u64(op.m.segv) << 16) | (u64(op.m.segr.uid()) << 32));
+					out.emplace_back(u64(op.m.base.uid()) | (u64(op.m.index.uid()) << 32));
+					out.emplace_back(u64(op.m.scale));
+					out.emplace_back(pd ? map(*pd) : u64(op.m.disp));
+					break;
+				case arch::mop_type::imm:
+					out.emplace_back(u64(op.i.width) | (u64(op.i.is_signed) << 16) | (u64(op.i.is_relative) << 17));
+					out.emplace_back(pd ? map(*pd) : op.i.u);
+					break;
+				default:
+					break;
+			}
+			out.emplace_back(u64(op.type) | (pd ? 0x100 : 0));
+		}
+	}
+
+	// Fingerprints the method at the given RVA by walking its machine code, masking the position dependent operands.
+	// - The walk order and the offsets where paths merge capture the shape of the control flow, the masked values are only
+	//   checked once a match is verified against the lifted template.
+	//
+	std::optional<u64> fingerprint_method(image* img, arch::handle arch, u64 rva) {
+		arch = arch ? arch : img->arch;
+		if (!arch)
+			return std::nullopt;
+
+		u64					hash	 = fnv1a_64_hasher::offset;
+		flat_uset<u64>		visited = {};
+		std::vector<u64>	stack	 = {rva};
+		std::vector<u64>	tokens = {};
+		while (!stack.empty()) {
+			u64 at = stack.back();
+			stack.pop_back();
+			while (true) {
+				// Mark where paths merge.
+				//
+				if (!visited.emplace(at).second) {
+					hash = fnv1a_64_hash(at - rva, hash);
+					break;
+				}
+				if (visited.size() > max_fingerprint_insns)
+					return std::nullopt;
+
+				// Decode the instruction, paths running into invalid code end there.
+				//
+				arch::minsn ins	= {};
+				auto			data = img->slice(at);
+				if (data.empty() || !img->decode_cache.decode(arch, data, at, ins)) {
+					hash = fnv1a_64_hash(u64(~0ull), hash);
+					break;
+				}
+				auto flow = arch->get_flow(ins);
+				if (flow == arch::minsn_flow::unknown)
+					return std::nullopt;
+
+				// Hash the instruction.
+				//
+				u64 ip = img->base_address + at;
+				tokens.clear();
+				tokenize(arch, ins, ip, has_reloc(img, at, ins.length), [](u64) { return u64(0); }, tokens);
+				for (u64 t : tokens)
+					hash = fnv1a_64_hash(t, hash);
+
+				// Follow the branch targets.
+				//
+				if (flow == arch::minsn_flow::branch || flow == arch::minsn_flow::jump) {
+					for (auto& op : ins.operands()) {
+						if (op.type == arch::mop_type::imm && op.i.is_relative) {
+							if (u64 adr = op.i.get_unsigned(ip); adr >= img->base_address)
+								stack.emplace_back(adr - img->base_address);
+						}
+					}
+				}
+
+				// Continue with the next instruction if it falls through.
+				//
+				if (flow == arch::minsn_flow::jump || flow == arch::minsn_flow::stop)
+					break;
+				at += ins.length;
+			}
+		}
+		return hash;
+	}
+
+	// Checks whether the code of the method at the given RVA is identical to the code lifted into the template routine once rebased.
+	// - Position dependent values have to point at the same offset if within the template, or at the same address otherwise.
+	// - Collects the addresses within the template that move with it, absolute values pointing into it are rejected as they do not.
+	//
+	static bool is_identical(image* img, arch::handle arch, const method* tmpl, const ir::routine* src, u64 rva, u64 lo, u64 hi, flat_uset<u64>& internal) {
+		i64				  delta = i64(rva - tmpl->rva);
+		std::vector<u64> lhs	 = {};
+		std::vector<u64> rhs	 = {};
+
+		// Addresses within the template become offsets, the rest stay as is.
+		//
+		auto map = [&](u64 base) {
+			return [=](u64 adr) { return (lo <= (adr - base) && (adr - base) <= hi) ? (adr - base - lo) : ~adr; };
+		};
+		auto record = [&](u64 adr) {
+			if (lo <= adr && adr <= hi)
+				internal.emplace(adr);
+			return map(0)(adr);
+		};
+
+		// Compare every instruction of the lifted blocks.
+		//
+		for (auto& bb : src->blocks) {
+			if (bb->ip == ir::NO_LABEL || bb->end_ip == ir::NO_LABEL)
+				continue;
+			for (u64 va = bb->ip; va < bb->end_ip;) {
+				u64			l_rva = va - img->base_address;
+				u64			r_rva = l_rva + delta;
+				arch::minsn l = {}, r = {};
+				if (!img->decode_cache.decode(arch, img->slice(l_rva), l_rva, l))
+					return false;
+				if (!img->decode_cache.decode(arch, img->slice(r_rva), r_rva, r))
+					return false;
+
+				lhs.clear();
+				rhs.clear();
+				bool relocated = has_reloc(img, l_rva, l.length);
+				tokenize(arch, l, va, relocated, record, lhs);
+				tokenize(arch, r, va + delta, has_reloc(img, r_rva, r.length), map(delta), rhs);
+				if (lhs != rhs)
+					return false;
+
+				// Absolute values pointing into the template are shared by both copies, the IR constants they produce cannot be told
+				// apart from the ones that have to be moved.
+				//
+				for (auto& op : l.operands()) {
+					if (get_position_dependent(arch, l, op, va, relocated))
+						continue;
+					if (op.type == arch::mop_type::imm && lo <= op.i.u && op.i.u <= hi)
+						return false;
+					if (op.type == arch::mop_type::mem && !op.m.base && !op.m.index && lo <= u64(op.m.disp) && u64(op.m.disp) <= hi)
+						return false;
+				}
+
+				// Instruction boundaries move with the template, e.g. return addresses and jump table targets.
+				//
+				internal.emplace(va);
+				internal.emplace(va + l.length);
+				va += l.length;
+			}
+		}
+
+		// Constants folded from outside the template do not move with it, reject if any of them may be an absolute address or
+		// an RVA pointing into it as the copy would end up pointing at itself.
+		//
+		size_t ptr_bytes		 = arch->get_pointer_width() / 8;
+		auto	 points_inside = [&](u64 b, u64 e) {
+			 auto data = img->slice(b);
+			 e			  = std::min<u64>(e, b + data.size());
+			 for (u64 o = b; o < e; o++) {
+				 u64	  v = 0;
+				 size_t n = std::min<size_t>(8, e - o);
+				 memcpy(&v, data.data() + (o - b), n);
+				 u64 ptr = ptr_bytes >= 8 ? v : (v & ((1ull << (ptr_bytes * 8)) - 1));
+				 u64 rva = img->base_address + u32(v);
+				 if ((n >= ptr_bytes && lo <= ptr && ptr <= hi) || (n >= 4 && lo <= rva && rva <= hi))
+					 return true;
+			 }
+			 return false;
+		};
+
+		// Compare the constants folded from within the template.
+		//
+		u64				 lo_rva = lo - img->base_address;
+		u64				 hi_rva = hi - img->base_address;
+		std::lock_guard _g{tmpl->const_reads_lock};
+		for (auto [b, e] : tmpl->const_reads) {
+			if (b < lo_rva && points_inside(b, std::min(e, lo_rva)))
+				return false;
+			if (hi_rva < e && points_inside(std::max(b, hi_rva), e))
+				return false;
+
+			b = std::max(b, lo_rva);
+			e = std::min(e, hi_rva);
+			if (b >= e)
+				continue;
+			auto l = img->slice(b);
+			auto r = img->slice(b + delta);
+			if (l.size() < (e - b) || r.size() < (e - b) || memcmp(l.data(), r.data(), e - b))
+				return false;
+		}
+		return true;
+	}
+
+	// Clones the template routine for the method, moving everything within the template by delta, or returns null if a constant
+	// within the template is not known to move with it.
+	//
+	static ref<ir::routine> rebase_routine(const ir::routine* src, method* m, i64 delta, u64 lo, u64 hi, const flat_uset<u64>& internal) {
+		auto rtn	  = src->clone();
+		rtn->method = m;
+		rtn->ip	  = src->ip + delta;
+
+		u32  ptr_width = m->arch->get_pointer_width();
+		auto ptr_int	= ir::int_type(ptr_width);
+		for (auto& bb : rtn->blocks) {
+			if (bb->ip != ir::NO_LABEL)
+				bb->ip += delta;
+			if (bb->end_ip != ir::NO_LABEL)
+				bb->end_ip += delta;
+
+			for (auto* ins : bb->insns()) {
+				if (ins->ip != ir::NO_LABEL)
+					ins->ip += delta;
+
+				// Pointer sized constants within the template are addresses of its code if they came from a position dependent value.
+				//
+				for (auto& op : ins->operands()) {
+					if (!op.is_const())
+						continue;
+					auto ty = op.get_type();
+					if (ty != ir::type::pointer && ty != ptr_int)
+						continue;
+					u64 v = op.get_const().get_u64();
+					if (v < lo || hi < v)
+						continue;
+					if (!internal.contains(v))
+						return nullptr;
+					op = ir::constant(ty, v + delta);
+				}
+			}
+			bb->rebuild_ip_index();
+		}
+
+		std::map<u64, ir::basic_block*> index = {};
+		for (auto& [ip, bb] : rtn->block_index)
+			index.emplace(ip + delta, bb);
+		rtn->block_index = std::move(index);
+		return rtn;
+	}
+
+	// Rebases the routine of an identical method onto a method that is about to be lifted, or returns null if there is none.
+	//
+	neo::subtask<ref<ir::routine>> rebase_identical(ref<method> m) {
+		auto img = m->img.lock();
+		if (!img || !img->dedup.enabled.load(std::memory_order::relaxed))
+			co_return nullptr;
+		auto fp = fingerprint_method(img.get(), m->arch, m->rva);
+		if (!fp)
+			co_return nullptr;
+
+		// Register as the template if first.
+		//
+		u64 tmpl_rva;
+		{
+			std::lock_guard _g{img->dedup.lock};
+			auto [it, inserted] = img->dedup.templates.try_emplace(*fp, m->rva);
+			if (inserted)
+				co_return nullptr;
+			tmpl_rva = it->second;
+		}
+
+		// Find the template and wait for it to be lifted.
+		//
+		ref<method>		tmpl	 = nullptr;
+		neo::promise<> lifter = {};
+		{
+			std::shared_lock _g{img->method_map_mtx};
+			if (auto it = img->method_map.find(tmpl_rva); it != img->method_map.end()) {
+				tmpl	 = it->second;
+				lifter = tmpl->irp_tasks[IRP_INIT];
+			}
+		}
+
+		// If it was dropped, take its place.
+		//
+		if (!tmpl) {
+			std::lock_guard _g{img->dedup.lock};
+			img->dedup.templates[*fp] = m->rva;
+			co_return nullptr;
+		}
+		if (tmpl == m || tmpl->arch != m->arch)
+			co_return nullptr;
+		if (!tmpl->irp_present(IRP_INIT)) {
+			try {
+				co_await lifter;
+			} catch (const neo::task_cancelled_exception&) {
+				co_return nullptr;
+			}
+		}
+
+		// Skip templates that were not lifted in full.
+		//
+		auto src = tmpl->get_irp(IRP_INIT);
+		if (!src || tmpl->init_info.limit_hit != lift_limit::none)
+			co_return nullptr;
+
+		// Find the range of the template and verify the match.
+		//
+		u64 lo = ~0ull, hi = 0;
+		for (auto& bb : src->blocks) {
+			if (bb->ip != ir::NO_LABEL && bb->end_ip != ir::NO_LABEL) {
+				lo = std::min(lo, bb->ip);
+				hi = std::max(hi, bb->end_ip);
+			}
+		}
+		flat_uset<u64> internal = {};
+		if (lo > hi || !is_identical(img.get(), m->arch, tmpl.get(), src.get(), m->rva, lo, hi, internal)) {
+			img->dedup.rejected++;
+			co_return nullptr;
+		}
+
+		// Rebase the routine and the analysis details.
+		//
+		i64  delta = i64(m->rva - tmpl->rva);
+		auto rtn	  = rebase_routine(src.get(), m.get(), delta, lo, hi, internal);
+		if (!rtn) {
+			img->dedup.rejected++;
+			co_return nullptr;
+		}
+		m->init_info = tmpl->init_info;
+		{
+			std::lock_guard _g{tmpl->const_reads_lock};
+			for (auto [b, e] : tmpl->const_reads) {
+				if ((lo - img->base_address) <= b && e <= (hi - img->base_address))
+					m->record_const_read(b + delta, e - b);
+				else
+					m->record_const_read(b, e - b);
+			}
+		}
+		img->dedup.hits++;
+		co_return rtn;
+	}
+};
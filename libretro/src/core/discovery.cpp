@@ -0,0 +1,197 @@
+#include <retro/core/method.hpp>
+#include <retro/core/image.hpp>
+#include <retro/ir/basic_block.hpp>
+#include <retro/ir/insn.hpp>
+#include <shared_mutex>
+
+namespace retro::core {
+	// Checks whether the given RVA may point to code.
+	//
+	static bool is_code_rva(const image* img, u64 rva) {
+		if (rva >= img->raw_data.size())
+			return false;
+		if (img->sections.empty())
+			return true;
+		auto* scn = img->find_section(rva);
+		return scn && scn->execute;
+	}
+
+	// Collects the method RVAs referenced by a lifted routine.
+	//
+	static void collect_targets(const image* img, const ir::routine* rtn, const discovery_options& opt, std::vector<u64>& out) {
+		u64 img_base = img->base_address;
+		auto push	 = [&](const ir::operand& op) {
+			 if (!op.is_const())
+				 return;
+			 auto ty = op.get_type();
+			 if (ty == ir::type::pointer || ty == ir::type::i32 || ty == ir::type::i64) {
+				 u64 va = op.get_const().get_u64();
+				 if (va >= img_base && is_code_rva(img, va - img_base))
+					 out.emplace_back(va - img_base);
+			 }
+		};
+
+		for (auto& bb : rtn->blocks) {
+			for (auto* ins : bb->insns()) {
+				// Branches within the method are already followed by the lifter.
+				//
+				if (ins->op == ir::opcode::xjmp || ins->op == ir::opcode::xjs)
+					continue;
+
+				if (ins->op == ir::opcode::xcall || ins->op == ir::opcode::call) {
+					if (opt.call_targets)
+						push(ins->opr(0));
+					if (!opt.code_refs)
+						continue;
+					for (size_t i = 1; i != ins->operand_count; i++)
+						push(ins->opr(i));
+				} else if (opt.code_refs) {
+					for (auto& op : ins->operands())
+						push(op);
+				}
+			}
+		}
+	}
+
+	// Collects the RVA ranges of the blocks lifted so far, sorted by start with the furthest end reached up to each.
+	//
+	static std::vector<std::pair<u64, u64>> get_lifted_ranges(image* img) {
+		std::vector<std::pair<u64, u64>> result = {};
+		{
+			std::shared_lock _g{img->method_map_mtx};
+			for (auto& [rva, m] : img->method_map) {
+				if (!m->irp_present(IRP_INIT))
+					continue;
+				if (auto rtn = m->get_irp(IRP_INIT)) {
+					for (auto& bb : rtn->blocks) {
+						if (bb->ip != ir::NO_LABEL && bb->end_ip != ir::NO_LABEL && bb->ip < bb->end_ip)
+							result.emplace_back(bb->ip - img->base_address, bb->end_ip - img->base_address);
+					}
+				}
+			}
+		}
+		range::sort(result);
+		for (size_t i = 1; i < result.size(); i++)
+			result[i].second = std::max(result[i].second, result[i - 1].second);
+		return result;
+	}
+
+	// Checks whether the RVA lies within a lifted block without being the entry point of a method.
+	//
+	static bool is_within_lifted(image* img, const std::vector<std::pair<u64, u64>>& ranges, u64 rva) {
+		auto it = std::upper_bound(ranges.begin(), ranges.end(), rva, [](u64 rva, auto& r) { return rva < r.first; });
+		if (it == ranges.begin() || std::prev(it)->second <= rva)
+			return false;
+		std::shared_lock _g{img->method_map_mtx};
+		return !img->method_map.contains(rva);
+	}
+
+	// Lifts a single method and returns the targets it references, or nullopt if it could not be lifted.
+	//
+	static neo::task<std::optional<std::vector<u64>>> discover_method(ref<image> img, u64 rva, discovery_options opt) {
+		// Failures of a single method should not abort the whole discovery.
+		//
+		ref<ir::routine> rtn = nullptr;
+		try {
+			rtn = co_await lift(img.get(), rva).queue(neo::scheduler::current());
+		} catch (const neo::task_cancelled_exception&) {
+			throw;
+		} catch (const std::exception&) {
+			rtn = nullptr;
+		}
+		if (!rtn) {
+			img->discovery.methods_failed++;
+			co_return std::nullopt;
+		}
+
+		if (auto m = rtn->method.lock()) {
+			img->discovery.blocks_lifted += m->init_info.stats_block_count;
+			img->discovery.insns_lifted += m->init_info.stats_insn_lifted;
+			if (m->init_info.limit_hit != lift_limit::none)
+				img->discovery.methods_truncated++;
+		}
+		img->discovery.methods_lifted++;
+
+		co_await neo::checkpoint{};
+		std::vector<u64> targets = {};
+		collect_targets(img, rtn, opt, targets);
+		co_return targets;
+	}
+
+	// Lifts every method reachable from the seeds of the image to a fixed point, returns the number of methods lifted.
+	// - Each round lifts the whole frontier in parallel, the targets they reference that were not seen before form the next one.
+	// - Relocation targets include the cases of jump tables, they are only seeded once the rest is lifted and skipped if they
+	//   fall within the lifted blocks.
+	//
+	neo::task<u64> discover(image* _img, discovery_options opt) {
+		ref<image> img = _img;
+
+		// Reset the progress of the previous runs.
+		//
+		auto& p = img->discovery;
+		for (auto* c : {&p.rounds, &p.methods_queued, &p.methods_lifted, &p.methods_failed, &p.blocks_lifted, &p.insns_lifted, &p.methods_truncated})
+			c->store(0, std::memory_order::relaxed);
+
+		// Gather the seeds.
+		//
+		flat_uset<u64>	  seen		= {};
+		std::vector<u64> frontier = {};
+		auto				  enqueue  = [&](u64 rva) {
+			  if (is_code_rva(img, rva) && seen.emplace(rva).second) {
+				  frontier.emplace_back(rva);
+				  img->discovery.methods_queued++;
+			  }
+		};
+		if (opt.entry_points) {
+			for (u64 rva : img->entry_points)
+				enqueue(rva);
+		}
+		if (opt.symbols) {
+			for (auto& sym : img->symbols) {
+				if (!sym.read_only_ignore)
+					enqueue(sym.rva);
+			}
+		}
+		std::vector<u64> deferred = {};
+		if (opt.relocs) {
+			for (auto& reloc : img->relocs) {
+				if (auto* target = std::get_if<u64>(&reloc.target))
+					deferred.emplace_back(*target);
+			}
+		}
+
+		// Lift until no new method is found.
+		//
+		u64 lifted = 0;
+		while (true) {
+			if (frontier.empty()) {
+				if (deferred.empty())
+					break;
+				auto ranges = get_lifted_ranges(img);
+				for (u64 rva : std::exchange(deferred, {})) {
+					if (!is_within_lifted(img, ranges, rva))
+						enqueue(rva);
+				}
+				if (frontier.empty())
+					break;
+			}
+
+			std::vector<neo::task<std::optional<std::vector<u64>>>> tasks = {};
+			tasks.reserve(frontier.size());
+			for (u64 rva : frontier)
+				tasks.emplace_back(discover_method(img, rva, opt));
+			frontier.clear();
+
+			auto results = co_await neo::when_all(std::move(tasks));
+			for (auto& targets : results) {
+				if (!targets)
+					continue;
+				lifted++;
+				for (u64 rva : *targets)
+					enqueue(rva);
+			}
+			img->discovery.rounds++;
+		}
+		co_return lifted;
+	}
+};
@@ -0,0 +1,317 @@
+#include <retro/core/callbacks.hpp>
+#include <retro/core/method.hpp>
+#include <retro/core/image.hpp>
+#include <retro/ir/basic_block.hpp>
+#include <retro/ir/insn.hpp>
+#include <retro/opt/interface.hpp>
+
+using namespace retro;
+using namespace retro::core;
+
+// Maximum number of entries a jump table can have.
+//
+static constexpr u64 max_jump_table_entries = 4096;
+
+// Checks whether the register read by the instruction is written between the start of its block and the instruction.
+//
+static bool is_reg_written_before(const ir::insn* i, arch::mreg r) {
+	for (auto i2 : i->bb->rslice(const_cast<ir::insn*>(i))) {
+		if (i2->desc().unk_reg_use)
+			return true;
+		if (i2->op == ir::opcode::write_reg && i2->opr(0).get_const().get<arch::mreg>() == r)
+			return true;
+	}
+	return false;
+}
+
+// Checks whether the register is written between the two instructions.
+//
+static bool is_reg_written_between(const ir::insn* from, const ir::insn* to, arch::mreg r) {
+	for (auto* i2 = from->next; i2 != to; i2 = i2->next) {
+		if (i2->desc().unk_reg_use)
+			return true;
+		if (i2->op == ir::opcode::write_reg && i2->opr(0).get_const().get<arch::mreg>() == r)
+			return true;
+	}
+	return false;
+}
+
+// Determines the number of index values the guard at the end of the predecessor lets through into the block, or 0 if it is not a bounded guard.
+// - The guard is evaluated natively by substituting the value the index register holds at the end of the predecessor.
+//
+static u64 find_guard_bound(ir::basic_block* pred, ir::basic_block* bb, arch::mreg r) {
+	auto* js = pred->terminator();
+	if (!js || js->op != ir::opcode::js)
+		return 0;
+	bool here_tb = js->opr(1).get_value() == (ir::value*) bb;
+	bool here_fb = js->opr(2).get_value() == (ir::value*) bb;
+	if (here_tb == here_fb)
+		return 0;
+
+	// Find the value of the register at the end of the predecessor.
+	//
+	const ir::insn* value = nullptr;
+	for (auto i2 : pred->rslice(js)) {
+		if (i2->desc().unk_reg_use)
+			return 0;
+		if (i2->op == ir::opcode::write_reg && i2->opr(0).get_const().get<arch::mreg>() == r) {
+			if (i2->opr(1).is_const())
+				return 0;
+			value = i2->opr(1).get_value()->get_if<ir::insn>();
+			if (!value)
+				return 0;
+			break;
+		}
+	}
+
+	// Evaluates whether the given index reaches the block, nullopt if the guard could not be evaluated.
+	//
+	u64  limit	 = ~0ull;
+	auto reaches = [&](u64 k) -> std::optional<bool> {
+		auto cc = ir::opt::const_eval(js->opr(0), [&](const ir::insn* i) -> ir::constant {
+			if (value ? i == value : (i->op == ir::opcode::read_reg && i->opr(0).get_const().get<arch::mreg>() == r)) {
+				if (u16 w = enum_reflect(i->get_type()).bit_size; w < 64)
+					limit = (1ull << w) - 1;
+				return ir::constant(i->get_type(), k);
+			}
+			return {};
+		});
+		if (!cc)
+			return std::nullopt;
+		return cc.get<bool>() == here_tb;
+	};
+
+	// Find the first index that does not reach the block.
+	//
+	u64 n = 0;
+	for (; n <= max_jump_table_entries; n++) {
+		auto res = reaches(n);
+		if (!res)
+			return 0;
+		if (!*res)
+			break;
+	}
+	if (n == 0 || n > max_jump_table_entries)
+		return 0;
+
+	// Make sure it is an upper bound and not an equality or a signed comparison.
+	//
+	for (u64 k : std::initializer_list<u64>{n + 1, n + 0x100, 0x80, 0x8000, 0x80000000, 0x8000000000000000, ~0ull}) {
+		if (k < n || k > limit)
+			continue;
+		if (reaches(k) != false)
+			return 0;
+	}
+	return n;
+}
+
+// Determines the number of entries the guards at the end of every predecessor bound the index to, or 0 if any of them is not one.
+//
+static u64 find_table_bound(ir::basic_block* bb, arch::mreg r) {
+	if (bb->predecessors.empty())
+		return 0;
+	u64 n = 0;
+	for (auto& pred : bb->predecessors) {
+		u64 bound = find_guard_bound(pred.get(), bb, r);
+		if (!bound)
+			return 0;
+		n = std::max(n, bound);
+	}
+	return n;
+}
+
+// Resolves bounded-index jump tables in read-only memory.
+//
+RC_INSTALL_CB(indirect_xjmp_resolver, jump_table, method* m, ir::insn* term) {
+	auto img = m->img.lock();
+	if (!img)
+		return false;
+	auto* bb		= term->bb;
+	auto* target = term->opr(0).is_const() ? nullptr : term->opr(0).get_value()->get_if<ir::insn>();
+	if (!target)
+		return false;
+
+	// Find the index, the only register the target depends on, and make sure it goes through a table load.
+	//
+	const ir::insn* index = nullptr;
+	bool				 multiple = false;
+	bool				 table	 = false;
+	ir::opt::const_eval(term->opr(0), [&](const ir::insn* i) -> ir::constant {
+		if (i->op == ir::opcode::load_mem) {
+			table = true;
+		} else if (i->op == ir::opcode::read_reg && !is_reg_written_before(i, i->opr(0).get_const().get<arch::mreg>())) {
+			if (index && index != i)
+				multiple = true;
+			index = i;
+			return ir::constant(i->get_type(), u64(0));
+		}
+		return {};
+	});
+	if (!index || multiple || !table)
+		return false;
+	auto reg = index->opr(0).get_const().get<arch::mreg>();
+
+	// Every predecessor should be a guard bounding the index.
+	//
+	u64 n = find_table_bound(bb, reg);
+	if (!n)
+		return false;
+
+	// Evaluate and validate every entry before resolving any of them, so that nothing is queued for a table that is rejected.
+	//
+	auto is_code = [&](u64 rva) {
+		auto* scn = img->find_section(rva);
+		if (!scn || !scn->execute)
+			return false;
+		auto		   data = img->slice(rva);
+		arch::minsn ins  = {};
+		return !data.empty() && img->decode_cache.decode(m->arch, data, rva, ins);
+	};
+	u32							  ptr_width = m->arch->get_pointer_width();
+	std::vector<u64>			  targets	= {};
+	for (u64 k = 0; k != n; k++) {
+		bool valid	= true;
+		auto target = ir::opt::const_eval(term->opr(0), [&](const ir::insn* i) -> ir::constant {
+			if (i == index)
+				return ir::constant(i->get_type(), k);
+
+			// Absolute entries should be relocated, if the image has relocations.
+			//
+			if (i->op == ir::opcode::load_mem && !img->relocs.empty()) {
+				auto ty = i->template_types[0];
+				if (ty == ir::type::pointer || enum_reflect(ty).bit_size == ptr_width) {
+					auto adr = ir::opt::const_eval(i->opr(0), [&](const ir::insn* i2) -> ir::constant {
+						return i2 == index ? ir::constant(i2->get_type(), k) : ir::constant{};
+					});
+					if (adr) {
+						u64 rva = adr.get_u64() + i->opr(1).get_const().get_i64() - img->base_address;
+						if (!find_rva_set_eq(img->relocs, rva))
+							valid = false;
+					}
+				}
+			}
+			return {};
+		});
+		if (!valid || !target)
+			return false;
+		u64 rva = target.get_u64() - img->base_address;
+		if (!is_code(rva))
+			return false;
+		targets.emplace_back(rva);
+	}
+
+	// Pick the register to dispatch on, the index if it is still intact at the end of the block, otherwise the register holding the target.
+	//
+	arch::mreg sel_reg;
+	ir::type	  sel_type;
+	bool		  by_index;
+	if (!is_reg_written_between(index, term, reg)) {
+		sel_reg	= reg;
+		sel_type = index->get_type();
+		by_index = true;
+	} else if (auto* rd = term->opr(0).is_const() ? nullptr : term->opr(0).get_value()->get_if<ir::insn>();
+				  rd && rd->op == ir::opcode::read_reg && rd->bb == bb) {
+		sel_reg = rd->opr(0).get_const().get<arch::mreg>();
+		if (is_reg_written_between(rd, term, sel_reg))
+			return false;
+		sel_type = rd->get_type();
+		by_index = false;
+	} else {
+		return false;
+	}
+
+	// Resolve the blocks, this may split the current one, cannot fail as the targets are within the image.
+	//
+	struct case_range {
+		u64					 hi;
+		ir::basic_block* dst;
+	};
+	std::vector<case_range> ranges = {};
+	for (u64 k = 0; k != n; k++) {
+		auto* dst = m->resolve_block(targets[k]);
+		RC_ASSERT(dst);
+		ranges.push_back({by_index ? k : targets[k] + img->base_address, dst});
+	}
+	if (!by_index) {
+		range::sort(ranges, [](auto& a, auto& b) { return a.hi < b.hi; });
+	}
+
+	// Merge adjacent entries with the same destination.
+	//
+	std::vector<case_range> merged = {};
+	for (auto& r : ranges) {
+		if (!merged.empty() && merged.back().dst == r.dst)
+			merged.back().hi = r.hi;
+		else
+			merged.emplace_back(r);
+	}
+
+	// Replace the terminator with a binary search over the ranges, each block reading the selector from the register again.
+	// - The dispatch carries the IP of the original terminator.
+	//
+	u64 ip	= term->ip;
+	bb			= term->bb;
+	auto* rtn = bb->rtn;
+	term->erase();
+
+	ir::insn* tail	 = bb->back();
+	auto		 at_ip = [&](ir::insn* i) {
+		i->ip = ip;
+		return i;
+	};
+	auto emit = [&](auto&& self, ir::basic_block* at, std::span<const case_range> rs) -> void {
+		if (rs.size() == 1) {
+			at_ip(at->push_jmp(rs[0].dst));
+			at->add_jump(rs[0].dst);
+			return;
+		}
+		auto lhs = rs.subspan(0, rs.size() / 2);
+		auto rhs = rs.subspan(rs.size() / 2);
+
+		ir::variant sel = at_ip(at->push_read_reg(sel_type, sel_reg));
+		auto			ty	 = sel_type;
+		if (ty == ir::type::pointer) {
+			ty	 = ir::int_type(ptr_width);
+			sel = at_ip(at->push_bitcast(ty, std::move(sel)));
+		}
+		auto* cc = at_ip(at->push_cmp(ir::op::ule, std::move(sel), ir::constant(ty, lhs.back().hi)));
+
+		ir::basic_block* dst[2] = {};
+		for (size_t i = 0; i != 2; i++) {
+			auto part = i == 0 ? lhs : rhs;
+			if (part.size() == 1) {
+				dst[i] = part[0].dst;
+			} else {
+				dst[i]		  = rtn->add_block();
+				dst[i]->arch = at->arch;
+			}
+		}
+		at_ip(at->push_js(cc, dst[0], dst[1]));
+		at->add_jump(dst[0]);
+		at->add_jump(dst[1]);
+		if (lhs.size() != 1)
+			self(self, dst[0], lhs);
+		if (rhs.size() != 1)
+			self(self, dst[1], rhs);
+	};
+	emit(emit, bb, merged);
+	ir::insn* head = tail ? tail->next : bb->front();
+
+	// Predecessors discovered later may reach the table unguarded, check again once the discovery is complete and restore the jump if so.
+	// - Everything the dispatch pushed after the original instructions is erased, the tree and the cases it alone reached are then
+	//   dropped by the caller as they are no longer reachable.
+	//
+	m->discovery_checks.emplace_back([=]() {
+		auto* at = head->bb;
+		if (u64 bound = find_table_bound(at, reg); bound && bound <= n)
+			return false;
+		while (!at->successors.empty())
+			at->del_jump(at->successors.back().get());
+		while (at->back() != head)
+			at->back()->erase();
+		head->erase();
+		at->push_xjmp(target)->ip = ip;
+		return true;
+	});
+	return true;
+}
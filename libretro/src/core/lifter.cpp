@@ -4,78 +4,117 @@
 #include <retro/core/callbacks.hpp>
 #include <retro/ir/z3x.hpp>
 #include <retro/opt/interface.hpp>
+#include <retro/opt/pass_manager.hpp>
 
 namespace retro::core {
 	// Helper for coercing an operand into a constant.
+	// - Tries the native evaluator first, Z3 is only used for what it cannot fold and while the method is within its budget.
 	//
-	static ir::constant* coerce_const(z3x::variable_set& vs, ir::operand& op) {
+	static ir::constant* coerce_const(z3x::variable_set& vs, ir::operand& op, const method* m, irp_init_info& stats) {
 		if (op.is_const())
 			return &op.const_val;
-		if (auto expr = z3x::to_expr(vs, z3x::get_context(), op)) {
-			if (auto v = z3x::value_of(expr, true)) {
+		if (auto v = ir::opt::const_eval(op)) {
+			if (v.get_type() != op.get_type())
 				v = v.bitcast(op.get_type());
-				RC_ASSERT(!v.is<void>());
+			if (v) {
 				op = std::move(v);
 				return &op.const_val;
 			}
 		}
+		if (m->check_budget(stats) != lift_limit::none)
+			return nullptr;
+
+		auto t0 = now();
+		auto v	= ir::constant{};
+		if (auto expr = z3x::to_expr(vs, z3x::get_context(), op))
+			v = z3x::value_of(expr, true);
+		stats.stats_z3_time_ns += chrono::duration_cast<chrono::nanoseconds>(now() - t0).count();
+		if (v) {
+			v = v.bitcast(op.get_type());
+			RC_ASSERT(!v.is<void>());
+			op = std::move(v);
+			return &op.const_val;
+		}
 		return nullptr;
 	}
 
-	// Lifts a basic block into the IRP_INIT IR from the given RVA.
+	// Checks the lifting budget of the image given the statistics not yet merged into init_info, does not check max_blocks.
 	//
-	neo::subtask<ir::basic_block*> method::build_block(u64 rva) {
-		ir::routine* rtn		 = routine[IRP_INIT].get();
-		u64			 img_base = img->base_address;
-		u64			 va		 = img_base + rva;
+	lift_limit method::check_budget(const irp_init_info& pending) const {
+		if (init_info.limit_hit != lift_limit::none)
+			return init_info.limit_hit;
+		if (pending.limit_hit != lift_limit::none)
+			return pending.limit_hit;
 
-		
-		// Invalid jump if out of image boundaries.
+		auto& lim = img->lift_limits;
+		if (u64 n = lim.max_insns.load(std::memory_order::relaxed); n && (init_info.stats_insn_lifted + pending.stats_insn_lifted) >= n)
+			return lift_limit::insns;
+		if (u64 n = lim.max_z3_time_ns.load(std::memory_order::relaxed); n && (init_info.stats_z3_time_ns + pending.stats_z3_time_ns) >= n)
+			return lift_limit::z3_time;
+
+		// Only read the clock if limited, this is called for every decoded instruction.
 		//
-		std::span<const u8> data = img->slice(rva);
-		if (data.empty()) {
-			co_return nullptr;
+		if (u64 n = lim.max_time_ns.load(std::memory_order::relaxed); n != 0) {
+			if ((now() - discovery_start) >= chrono::nanoseconds(n))
+				return lift_limit::time;
 		}
+		return lift_limit::none;
+	}
+
+	// Ends a block with a trap noting the budget that was exceeded.
+	//
+	static void push_budget_trap(ir::basic_block* bb, u64 ip, lift_limit limit) {
+		static constexpr const char* names[] = {"none", "blocks", "instructions", "time", "z3 time"};
+		bb->push_trap(std::string{"lifting budget exceeded: "} + names[(u8) limit])->ip = ip;
+	}
 
-		// First check the basic block list for an already lifted range.
+	// Resolves the block starting at the given RVA, splitting an already lifted one or queueing a new one for decoding.
+	//
+	ir::basic_block* method::resolve_block(u64 rva) {
+		ir::routine* rtn = routine[IRP_INIT].get();
+		u64			 va  = img->base_address + rva;
+
+		// Invalid jump if out of image boundaries.
 		//
-		for (ir::basic_block* bbs : rtn->blocks) {
-			// Skip if not within the range.
-			//
-			if (va < bbs->ip || bbs->end_ip <= va)
-				continue;
+		if (img->slice(rva).empty()) {
+			return nullptr;
+		}
 
+		// First check the block index for an already lifted range.
+		//
+		if (ir::basic_block* bbs = rtn->find_block(va)) {
 			// If exact match, no need to lift anything.
 			//
 			if (bbs->ip == va)
-				co_return bbs;
+				return bbs;
 
 			// Find the label.
 			//
-			auto non_nop = false;
-			for (auto* ins : bbs->insns()) {
-				if (ins->ip != va) {
-					non_nop = non_nop || ins->op != ir::opcode::nop;
-					continue;
-				}
-
+			if (ir::insn* ins = bbs->find_ip(va)) {
 				// No need to split if the instructions we've skipped have no effect.
 				//
+				auto non_nop = false;
+				for (auto* it = ins->prev; it != bbs->entry(); it = it->prev) {
+					if (it->op != ir::opcode::nop) {
+						non_nop = true;
+						break;
+					}
+				}
 				if (!non_nop) {
-					co_return bbs;
+					return bbs;
 				}
 
 				// Split the block, add a jump from the previous block to this one.
 				//
 				auto new_block = bbs->split(ins);
 				if (!new_block)
-					co_return bbs;
+					return bbs;
 				bbs->push_jmp(new_block);
 				bbs->add_jump(new_block);
 
 				// Return it.
 				//
-				co_return new_block;
+				return new_block;
 			}
 
 			// Misaligned jump, sneaky! Lift as a new block.
@@ -83,11 +122,10 @@ namespace retro::core {
 			fmt::println("Misaligned jump?");
 		}
 
-		// Add a new block.
+		// Add a new block and queue it for decoding.
 		//
 		init_info.stats_block_count++;
-		auto* bb	  = rtn->add_block();
-		bb->ip	  = va;
+		auto* bb	  = rtn->add_block(va);
 		bb->end_ip = va;
 		bb->arch	  = arch;
 
@@ -97,22 +135,37 @@ namespace retro::core {
 			auto frame = bb->push_bitcast(ir::int_type(arch->get_pointer_width()), bb->push_stack_begin());
 			arch->explode_write_reg(bb->push_write_reg(arch->get_stack_register(), frame));
 		}
+		discovery_queue.emplace_back(bb);
+		return bb;
+	}
+
+	// Decodes and lifts the instructions of a queued block until a terminator, only touches the block itself.
+	//
+	void method::decode_block(ir::basic_block* bb, irp_init_info& stats) {
+		u64						 va	= bb->ip;
+		std::span<const u8> data = img->slice(va - img->base_address);
 
 		// Until we run out of instructions to decode:
 		//
-		while (!data.empty()) {
-			// Yield.
-			//
-			co_await neo::checkpoint{};
+		while (true) {
+			if (auto limit = check_budget(stats); limit != lift_limit::none) {
+				stats.limit_hit = limit;
+				push_budget_trap(bb, va, limit);
+				break;
+			}
+			if (data.empty()) {
+				bb->push_trap("unexpected end of image")->ip = va;
+				break;
+			}
 
-			// Diassemble the instruction, push trap on failure and break.
+			// Diassemble the instruction through the image cache, push trap on failure and break.
 			//
 			arch::minsn ins = {};
-			if (!arch->disasm(data, &ins)) {
+			if (!img->decode_cache.decode(arch, data, va - img->base_address, ins)) {
 				bb->push_trap("undefined opcode")->ip = va;
 				break;
 			}
-			init_info.stats_minsn_disasm++;
+			stats.stats_minsn_disasm++;
 
 			// Update the block range.
 			//
@@ -133,7 +186,12 @@ namespace retro::core {
 				while (it != bb->begin() && it->prev->ip == va) {
 					--it;
 				}
-				init_info.stats_insn_lifted += std::distance(it, bb->end());
+				stats.stats_insn_lifted += std::distance(it, bb->end());
+
+				// Index the first instruction of the IP, the arch assigns the IPs only once done lifting.
+				//
+				if (it->ip == va && (bb->ip_index.empty() || bb->ip_index.back().first < va))
+					bb->ip_index.emplace_back(va, it.get());
 			}
 
 			// If XCALL:
@@ -142,7 +200,7 @@ namespace retro::core {
 				// Coerce first operand into a constant where possible.
 				//
 				z3x::variable_set vs;
-				coerce_const(vs, i->opr(0));
+				coerce_const(vs, i->opr(0), this, stats);
 
 				// Invoke the callbacks.
 				//
@@ -159,23 +217,47 @@ namespace retro::core {
 			data = data.subspan(ins.length);
 			va += ins.length;
 		}
+	}
 
-		// Try to continue traversal.
-		//
+	// Cuts the decoded blocks that ran into the start of another block, jumping to it instead of keeping a copy of its instructions.
+	//
+	void method::cut_overlaps(std::span<ir::basic_block* const> batch) {
+		ir::routine* rtn = routine[IRP_INIT].get();
+		for (auto* bb : batch) {
+			for (auto it = rtn->block_index.upper_bound(bb->ip); it != rtn->block_index.end() && it->first < bb->end_ip; ++it) {
+				ir::basic_block* next = it->second;
+				ir::insn*		  ins	 = bb->find_ip(next->ip);
+				if (!ins)
+					continue;
+
+				// The tail is not yet linked anywhere and is not indexed as the other block holds its start, drop it.
+				//
+				auto* tail = bb->split(ins);
+				bb->push_jmp(next);
+				bb->add_jump(next);
+				rtn->del_block(tail);
+				break;
+			}
+		}
+	}
+
+	// Links a block terminator to its targets once they exist, resolving them queues the new ones for decoding.
+	//
+	void method::link_terminator(ir::insn* term) {
+		irp_init_info		stats = {};
 		z3x::variable_set vs;
-		auto*					bb_ret = bb;
-		auto*					term = bb->terminator();
+		u64					img_base = img->base_address;
 		switch (term->op) {
 			case ir::opcode::xjs: {
-				// Try lifting both blocks.
+				// Try resolving both blocks.
 				//
 				ir::basic_block* bbs[2] = {nullptr, nullptr};
 				for (size_t i = 0; i != 2; i++) {
-					bbs[i] = co_await build_block(term->opr(i + 1).const_val.get_u64() - img_base);
-					bb		 = term->bb;
+					bbs[i] = resolve_block(term->opr(i + 1).const_val.get_u64() - img_base);
 				}
+				ir::basic_block* bb = term->bb;
 
-				// If we managed to lift both blocks succesfully:
+				// If we managed to resolve both blocks succesfully:
 				//
 				if (bbs[0] && bbs[1]) {
 					// Replace with js.
@@ -191,11 +273,11 @@ namespace retro::core {
 			case ir::opcode::xjmp: {
 				// Try coercing destination into a constant.
 				//
-				if (coerce_const(vs, term->opr(0))) {
-					// Lift the target block.
+				if (coerce_const(vs, term->opr(0), this, stats)) {
+					// Resolve the target block.
 					//
-					if (auto target = co_await build_block(term->opr(0).const_val.get_u64() - img_base)) {
-						bb = term->bb;
+					if (auto target = resolve_block(term->opr(0).const_val.get_u64() - img_base)) {
+						ir::basic_block* bb = term->bb;
 
 						// Replace with jmp if successful.
 						//
@@ -214,37 +296,113 @@ namespace retro::core {
 			default:
 				break;
 		}
-		co_return bb_ret;
+		init_info += stats;
 	}
 
+	// Discovers the control flow starting from the given RVA and lifts it into the IRP_INIT IR.
+	// - Works through the queued blocks in rounds: decodes the round, in parallel if large enough, and then links
+	//   their terminators, which queues the blocks of the next round.
+	// - Once the lifting budget is exceeded, the blocks left in the queue end with a trap instead.
+	//
+	neo::subtask<ir::basic_block*> method::build_block(u64 rva) {
+		ir::basic_block* result	= resolve_block(rva);
+		u64				  decoded = 0;
+		while (!discovery_queue.empty()) {
+			auto batch = std::exchange(discovery_queue, {});
+
+			// Check the budget, keeping the blocks that fit within it.
+			//
+			size_t n		 = batch.size();
+			auto	 limit = check_budget();
+			if (limit != lift_limit::none) {
+				n = 0;
+			} else if (u64 max = img->lift_limits.max_blocks.load(std::memory_order::relaxed); max && (decoded + n) > max) {
+				n		= max > decoded ? max - decoded : 0;
+				limit = lift_limit::blocks;
+			}
+			if (limit != lift_limit::none) {
+				init_info.limit_hit = limit;
+				for (auto* bb : std::span{batch}.subspan(n))
+					push_budget_trap(bb, bb->ip, limit);
+				batch.resize(n);
+			}
+			decoded += n;
 
-	// Lifts a new method into the image at the given RVA, if it does not already exist.
-	// - If there is an existing entry, returns it, otherwise inserts an entry and starts lifting.
+			// Decode the blocks, they are independent from each other until linked.
+			//
+			if (size_t min = parallel_discovery_min.load(std::memory_order::relaxed); min && batch.size() >= min) {
+				struct decode_job {
+					std::vector<ir::basic_block*> blocks = {};
+					std::vector<irp_init_info>	   stats	 = {};
+				};
+				auto job	  = make_rc<decode_job>();
+				job->blocks = std::move(batch);
+				job->stats.resize(job->blocks.size());
+				co_await neo::parallel_for(0, job->blocks.size(), 1, [self = ref<method>(this), job](size_t i) {
+					self->decode_block(job->blocks[i], job->stats[i]);
+				});
+				for (auto& s : job->stats)
+					init_info += s;
+				batch = std::move(job->blocks);
+			} else {
+				for (auto* bb : batch) {
+					co_await neo::checkpoint{};
+					irp_init_info stats = {};
+					decode_block(bb, stats);
+					init_info += stats;
+				}
+			}
+			cut_overlaps(batch);
+
+			// Link the terminators.
+			//
+			std::vector<ir::insn*> terms = {};
+			for (auto* bb : batch) {
+				if (auto* term = bb->terminator())
+					terms.emplace_back(term);
+			}
+			for (auto* term : terms) {
+				co_await neo::checkpoint{};
+				link_terminator(term);
+			}
+		}
+
+		// Let the resolvers check the assumptions they made on the control flow, dropping the blocks only the reverted edges reached.
+		//
+		bool reverted = false;
+		for (auto& check : std::exchange(discovery_checks, {}))
+			reverted |= check();
+		if (reverted)
+			routine[IRP_INIT]->del_unreachable_blocks();
+		co_return result;
+	}
+
+	// Builds the IRP_INIT routine of a new method and publishes the phase once done.
 	//
-	static neo::subtask<void> lifter_task(ref<method> m, u64 rva) {
+	static neo::task<void> lifter_task(ref<method> m, u64 rva) {
 		auto& rtn = m->routine[IRP_INIT];
 
+		// If there is an identical method, share its routine.
+		//
+		m->discovery_start = now();
+		if (auto dup = co_await rebase_identical(m)) {
+			rtn = std::move(dup);
+		}
 		// If lifter fails, clear out the routine.
 		//
-		if (!co_await m->build_block(rva)) {
+		else if (!co_await m->build_block(rva)) {
 			rtn = nullptr;
 		}
 		// Otherwise:
 		//
 		else {
-			// Apply local optimizations.
+			// Apply the optimization pipeline selected for the image.
 			//
-			for (auto& bb : rtn->blocks) {
-				co_await neo::checkpoint{};
-				ir::opt::init::reg_move_prop(bb);
-				ir::opt::const_fold(bb);
-				ir::opt::const_load(bb);
-				ir::opt::id_fold(bb);
-				ir::opt::ins_combine(bb);
-				ir::opt::const_fold(bb);
-				ir::opt::id_fold(bb);
-				// TODO: Cfg optimization
-			}
+			auto pl = ir::opt::get_pipeline(m->img->get_opt_pipeline());
+			if (!pl)
+				pl = ir::opt::get_pipeline("init");
+			co_await ir::opt::run_pipeline(std::move(pl), rtn);
+			// TODO: Cfg optimization
 
 			// Sort the blocks in topological order and rename all values.
 			//
@@ -253,43 +411,66 @@ namespace retro::core {
 			rtn->rename_insns();
 		}
 
-		// Mark IR phase as finished, return the method.
+		// Mark IR phase as finished.
 		//
-		// // TODO: For demo.
-//		m->irp_mask.fetch_or(1u << IRP_INIT);
-//		m->irp_mask.notify_all();
-//		on_irp_complete(m, IRP_INIT);
+		m->irp_mask.fetch_or(1u << IRP_INIT);
+		m->irp_mask.notify_all();
+		on_irp_complete(m, IRP_INIT);
 		co_return;
 	}
+
+	// Lifts a new method into the image at the given RVA, if it does not already exist.
+	// - If there is an existing entry, awaits the lifter that is building it, otherwise inserts an entry and starts lifting.
+	//
 	neo::task<ref<ir::routine>> lift(image* img, u64 rva, arch::handle arch) {
 		arch = arch ? arch : img->arch;
 		if (!arch)
 			co_return nullptr;
 
-		// Return if there is an exact match.
+		// Join the lifter if there is an exact match.
 		//
 		std::unique_lock lock{img->method_map_mtx};
-		auto& mfound = img->method_map[rva];
-		if (mfound && mfound->arch == arch) {
-			co_return mfound->routine[IRP_INIT];
+		auto&			  mfound = img->method_map[rva];
+		ref<method>	  m		= mfound;
+		if (!m || m->arch != arch) {
+			// Replace it with our new entry.
+			//
+			m		  = make_rc<method>();
+			mfound  = m;
+			m->rva  = rva;
+			m->arch = arch;
+			m->img  = img;
+
+			// Start lifting from the entry point, publishing the lifter before anyone else can see the entry.
+			//
+			auto rtn					  = make_rc<ir::routine>();
+			rtn->method				  = m;
+			rtn->ip					  = rva + img->base_address;
+			m->routine[IRP_INIT]	  = rtn;
+			m->irp_tasks[IRP_INIT] = lifter_task(m, rva).queue(neo::scheduler::current());
 		}
+		neo::promise<> lifter = m->irp_tasks[IRP_INIT];
+		lock.unlock();
 
-		// Replace it with our new entry.
+		// Wait for the lifter to finish.
 		//
-		auto m  = make_rc<method>();
-		mfound  = m;
-		m->rva  = rva;
-		m->arch = arch;
-		m->img  = img;
+		if (!m->irp_present(IRP_INIT)) {
+			bool cancelled = false;
+			try {
+				co_await lifter;
+			} catch (const neo::task_cancelled_exception&) {
+				cancelled = true;
+			}
 
-		// Recursively lift starting from the entry point.
-		//
-		auto rtn					  = make_rc<ir::routine>();
-		rtn->method				  = m;
-		rtn->ip					  = rva + img->base_address;
-		m->routine[IRP_INIT]	  = rtn;
-		lock.unlock();
-		co_await lifter_task(m, rva);
-		co_return rtn;
+			// If it was cancelled, drop the half-built entry so that the next request starts over.
+			//
+			if (cancelled) {
+				lock.lock();
+				if (auto it = img->method_map.find(rva); it != img->method_map.end() && it->second == m)
+					img->method_map.erase(it);
+				co_return nullptr;
+			}
+		}
+		co_return m->routine[IRP_INIT];
 	}
 };
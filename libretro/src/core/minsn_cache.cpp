@@ -0,0 +1,147 @@
+#include <retro/core/minsn_cache.hpp>
+#include <retro/core/image.hpp>
+#include <mutex>
+#include <shared_mutex>
+
+namespace retro::core {
+	// Looks up the instruction at the given RVA decoded by the given architecture.
+	//
+	bool minsn_cache::lookup(u64 rva, arch::handle arch, arch::minsn& out) const {
+		auto& s = shard_of(rva);
+		{
+			std::shared_lock _g{s.mtx};
+			if (auto it = s.map.find(rva); it != s.map.end() && it->second.ins.arch == (u32) arch) {
+				out = it->second.ins;
+				hits.fetch_add(1, std::memory_order::relaxed);
+				return true;
+			}
+		}
+		misses.fetch_add(1, std::memory_order::relaxed);
+		return false;
+	}
+
+	// Inserts a decoded instruction, evicting the oldest entry of the shard if full.
+	//
+	void minsn_cache::insert(u64 rva, const arch::minsn& ins) {
+		size_t limit = std::max<size_t>(capacity.load(std::memory_order::relaxed) / shard_count, 1);
+		auto&	 s		= shard_of(rva);
+
+		std::unique_lock _g{s.mtx};
+		auto [it, inserted] = s.map.try_emplace(rva);
+		it->second.ins		  = ins;
+		if (!inserted)
+			return;
+		u64 gen			= ++s.next_gen;
+		it->second.gen = gen;
+
+		// Take the next slot of the ring once full, evicting its entry unless the slot went stale.
+		//
+		if (s.order.size() < limit) {
+			s.order.emplace_back(rva, gen);
+		} else {
+			s.cursor %= s.order.size();
+			auto [old_rva, old_gen] = std::exchange(s.order[s.cursor], {rva, gen});
+			if (auto old = s.map.find(old_rva); old != s.map.end() && old->second.gen == old_gen)
+				s.map.erase(old);
+			s.cursor++;
+		}
+	}
+
+	// Decodes the instruction at the given RVA through the cache, returns false on failure.
+	//
+	bool minsn_cache::decode(arch::handle arch, std::span<const u8> data, u64 rva, arch::minsn& out) {
+		if (!lookup(rva, arch, out)) {
+			if (!arch->disasm(data, &out)) {
+				out		  = {};
+				out.arch	  = (u32) arch;
+				out.length = 0;
+			}
+			insert(rva, out);
+		}
+		return out.length != 0;
+	}
+
+	// Drops every entry overlapping [begin, end).
+	//
+	void minsn_cache::invalidate(u64 begin, u64 end) {
+		for (auto& s : shards) {
+			std::unique_lock _g{s.mtx};
+			for (auto it = s.map.begin(); it != s.map.end();) {
+				u64 len = std::max<u64>(it->second.ins.length, 1);
+				if (it->first < end && begin < it->first + len)
+					it = s.map.erase(it);
+				else
+					++it;
+			}
+		}
+	}
+
+	// Drops every entry.
+	//
+	void minsn_cache::clear() {
+		for (auto& s : shards) {
+			std::unique_lock _g{s.mtx};
+			s.map.clear();
+			s.order.clear();
+			s.cursor = 0;
+		}
+	}
+
+	// Number of entries.
+	//
+	size_t minsn_cache::size() const {
+		size_t n = 0;
+		for (auto& s : shards) {
+			std::shared_lock _g{s.mtx};
+			n += s.map.size();
+		}
+		return n;
+	}
+
+	// Fills the decode cache of the image with a parallel linear sweep over its executable sections.
+	//
+	neo::task<u64> predecode(image* _img, arch::handle arch) {
+		ref<image> img = _img;
+		arch			   = arch ? arch : img->arch;
+		if (!arch)
+			co_return 0;
+
+		// Split the executable sections into chunks.
+		//
+		static constexpr u64 chunk_size = 64 * 1024;
+		struct sweep_job {
+			std::vector<std::pair<u64, u64>> chunks  = {};
+			std::atomic<u64>					  decoded = 0;
+		};
+		auto job = make_rc<sweep_job>();
+		for (auto& scn : img->sections) {
+			if (!scn.execute)
+				continue;
+			u64 end = std::min<u64>(scn.rva_end, img->raw_data.size());
+			for (u64 rva = scn.rva; rva < end; rva += chunk_size)
+				job->chunks.emplace_back(rva, std::min(rva + chunk_size, end));
+		}
+
+		// Sweep them in parallel.
+		//
+		co_await neo::parallel_for(0, job->chunks.size(), 1, [img, arch, job](size_t i) {
+			auto& cache = img->decode_cache;
+			if (cache.size() >= cache.capacity.load(std::memory_order::relaxed))
+				return;
+
+			auto [rva, end] = job->chunks[i];
+			u64 n				 = 0;
+			while (rva < end) {
+				arch::minsn ins = {};
+				if (cache.decode(arch, img->slice(rva), rva, ins)) {
+					rva += ins.length;
+					n++;
+				} else {
+					rva++;
+				}
+			}
+			job->decoded += n;
+		});
+		co_return job->decoded.load();
+	}
+};
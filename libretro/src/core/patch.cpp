@@ -0,0 +1,138 @@
+#include <retro/core/method.hpp>
+#include <retro/core/image.hpp>
+#include <retro/ir/basic_block.hpp>
+#include <algorithm>
+#include <mutex>
+#include <shared_mutex>
+
+namespace retro::core {
+	// Writes bytes into the image, recording the range as dirty and dropping the cached instructions overlapping it.
+	//
+	bool image::write(u64 rva, std::span<const u8> data) {
+		if (data.empty())
+			return true;
+		if (rva > raw_data.size() || data.size() > (raw_data.size() - rva))
+			return false;
+
+		// Tasks lifting, discovering or decoding from the image read the bytes without locks, refuse to patch under them.
+		// - Lifts may also be started outside the task group, holding the method map prevents new ones from starting while
+		//   writing and lets us check the ones in progress.
+		//
+		std::unique_lock _m{method_map_mtx};
+		if (task_group->size() != 0)
+			return false;
+		for (auto& [_, m] : method_map) {
+			if (!m->irp_present(IRP_INIT))
+				return false;
+		}
+		memcpy(raw_data.data() + rva, data.data(), data.size());
+
+		// Instructions may start up to their maximum length before the range.
+		//
+		u64 end = rva + data.size();
+		decode_cache.invalidate(rva >= 16 ? rva - 16 : 0, end);
+
+		std::lock_guard _g{dirty_lock};
+		dirty_ranges.emplace_back(rva, end);
+		return true;
+	}
+
+	// Checks whether patching the RVA range [begin, end) invalidates the method.
+	//
+	bool method::depends_on(u64 begin, u64 end) const {
+		// Failed lifts have no blocks, assume they depend on their entry point.
+		//
+		if (begin <= rva && rva < end)
+			return true;
+
+		// Check every block as they may overlap when misaligned, end_ip is exclusive.
+		//
+		if (auto& rtn = routine[IRP_INIT]) {
+			auto img = this->img.lock();
+			if (!img)
+				return false;
+			u64 va_begin = begin + img->base_address;
+			u64 va_end	 = end + img->base_address;
+			for (auto& bb : rtn->blocks) {
+				if (bb->ip != ir::NO_LABEL && bb->end_ip != ir::NO_LABEL && bb->ip < va_end && va_begin < bb->end_ip)
+					return true;
+			}
+		}
+
+		// Check the constant memory folded into the IR, including the jump tables read by the resolvers.
+		//
+		std::lock_guard _g{const_reads_lock};
+		for (auto& [b, e] : const_reads) {
+			if (b < end && begin < e)
+				return true;
+		}
+		return false;
+	}
+
+	// Re-lifts the methods invalidated by the patches written to the image since the last call.
+	//
+	neo::task<u64> relift(image* _img) {
+		ref<image> img = _img;
+
+		// Take the dirty ranges and merge them.
+		//
+		std::vector<std::pair<u64, u64>> ranges;
+		{
+			std::lock_guard _g{img->dirty_lock};
+			ranges = std::exchange(img->dirty_ranges, {});
+		}
+		if (ranges.empty())
+			co_return 0;
+		range::sort(ranges);
+		std::vector<std::pair<u64, u64>> merged = {};
+		for (auto& r : ranges) {
+			if (!merged.empty() && r.first <= merged.back().second)
+				merged.back().second = std::max(merged.back().second, r.second);
+			else
+				merged.emplace_back(r);
+		}
+
+		// Drop the methods depending on them, anyone looking them up from now on lifts them again.
+		//
+		std::vector<std::pair<u64, arch::handle>> invalidated = {};
+		flat_uset<u64>										dropped	   = {};
+		{
+			std::unique_lock _g{img->method_map_mtx};
+			for (auto it = img->method_map.begin(); it != img->method_map.end();) {
+				auto& m		= it->second;
+				bool	dirty = range::any_of(merged, [&](auto& r) { return m->depends_on(r.first, r.second); });
+				if (dirty) {
+					invalidated.emplace_back(it->first, m->arch);
+					dropped.emplace(it->first);
+					it = img->method_map.erase(it);
+				} else {
+					++it;
+				}
+			}
+		}
+
+		// Forget them as deduplication templates, their code may no longer match the fingerprint.
+		//
+		{
+			std::lock_guard _g{img->dedup.lock};
+			for (auto it = img->dedup.templates.begin(); it != img->dedup.templates.end();) {
+				if (dropped.contains(it->second))
+					it = img->dedup.templates.erase(it);
+				else
+					++it;
+			}
+		}
+
+		// Lift them again in parallel.
+		//
+		std::vector<neo::task<ref<ir::routine>>> tasks = {};
+		tasks.reserve(invalidated.size());
+		for (auto& [rva, arch] : invalidated)
+			tasks.emplace_back(lift(img.get(), rva, arch));
+
+		u64 n = 0;
+		for (auto& rtn : co_await neo::when_all(std::move(tasks)))
+			n += rtn != nullptr;
+		co_return n;
+	}
+};
@@ -35,4 +35,18 @@ namespace retro::core {
 		}
 		return result;
 	}
+
+	// Removes an image from the workspace and cancels the tasks working on it.
+	//
+	bool workspace::close_image(image* img) {
+		{
+			std::unique_lock _g{image_list_mtx};
+			auto it = range::find_if(image_list, [&](auto& i) { return i == img; });
+			if (it == image_list.end())
+				return false;
+			image_list.erase(it);
+		}
+		img->task_group->cancel();
+		return true;
+	}
 };
\ No newline at end of file
@@ -21,7 +21,7 @@ namespace retro::ir {
 			v->arch = arch;
 
 		v->bb = this;
-		v->name	= rtn->next_ins_name++;
+		v->name	= rtn->next_ins_name.fetch_add(1, std::memory_order::relaxed);
 		list::link_before(position.get(), v.get());
 		return {v.release()};
 	}
@@ -54,18 +54,19 @@ namespace retro::ir {
 		if (boundary == begin()) {
 			return nullptr;
 		}
-		auto* blk = rtn->add_block();
+		auto* blk = rtn->add_block(boundary == end() ? this->end_ip : boundary->ip);
 		blk->end_ip = this->end_ip;
 		blk->arch	= this->arch;
 		if (boundary == end()) {
-			blk->ip = this->end_ip;
 			return blk;
 		}
 
-		// Update the tracked IP ranges.
+		// Update the tracked IP ranges and move the tail of the instruction index.
 		//
-		blk->ip		 = boundary->ip;
 		this->end_ip = boundary->ip;
+		auto split_at = std::lower_bound(ip_index.begin(), ip_index.end(), blk->ip, [](auto& e, u64 ip) { return e.first < ip; });
+		blk->ip_index.assign(std::make_move_iterator(split_at), std::make_move_iterator(ip_index.end()));
+		ip_index.erase(split_at, ip_index.end());
 
 		// Manually split the list.
 		//
@@ -213,6 +214,34 @@ namespace retro::ir {
 		}
 	}
 
+	// Finds the first instruction with the given IP, null if there is none.
+	//
+	insn* basic_block::find_ip(u64 ip) {
+		auto lookup = [&]() -> insn* {
+			auto it = std::lower_bound(ip_index.begin(), ip_index.end(), ip, [](auto& e, u64 ip) { return e.first < ip; });
+			if (it == ip_index.end() || it->first != ip)
+				return nullptr;
+			auto i = it->second.lock();
+			if (!i || i->bb != this || i->ip != ip || (i->prev != entry() && i->prev->ip == ip))
+				return nullptr;
+			return i;
+		};
+		if (auto* i = lookup())
+			return i;
+
+		// Entries may have gone stale due to erasures or insertions in the middle, rebuild and retry.
+		//
+		rebuild_ip_index();
+		return lookup();
+	}
+	void basic_block::rebuild_ip_index() {
+		ip_index.clear();
+		for (auto* i : insns()) {
+			if (i->ip != NO_LABEL && (ip_index.empty() || ip_index.back().first < i->ip))
+				ip_index.emplace_back(i->ip, i);
+		}
+	}
+
 	// Deref and oprhan all instructions on destruction.
 	//
 	basic_block::~basic_block() {
@@ -66,6 +66,8 @@ namespace retro::ir {
 		for (auto ins : blk->insns()) {
 			auto new_ins = pre_clone(ins, mark);
 			new_ins->bb = new_blk;
+			if (new_ins->ip != NO_LABEL && (new_blk->ip_index.empty() || new_blk->ip_index.back().first < new_ins->ip))
+				new_blk->ip_index.emplace_back(new_ins->ip, new_ins.get());
 			list::link_before(new_blk->end().get(), new_ins.release());
 		}
 		return new_blk;
@@ -95,7 +97,7 @@ namespace retro::ir {
 		new_rtn->ip							 = rtn->ip;
 		new_rtn->method					 = rtn->method;
 		new_rtn->next_blk_name			 = rtn->next_blk_name;
-		new_rtn->next_ins_name			 = rtn->next_ins_name;
+		new_rtn->next_ins_name			 = rtn->next_ins_name.load(std::memory_order::relaxed);
 		new_rtn->last_cfg_modify_timer = rtn->last_cfg_modify_timer;
 
 		// Copy each basic block.
@@ -107,6 +109,8 @@ namespace retro::ir {
 			new_blk->rtn		 = new_rtn;
 			if (rtn->blocks[n] == rtn->entry_point)
 				new_rtn->entry_point = new_blk;
+			if (auto it = rtn->block_index.find(new_blk->ip); it != rtn->block_index.end() && it->second == rtn->blocks[n])
+				new_rtn->block_index.emplace(new_blk->ip, new_blk.get());
 			new_rtn->blocks[n] = std::move(new_blk);
 		}
 		return new_rtn;
@@ -6,12 +6,16 @@
 namespace retro::ir {
 	// Creates or removes a block.
 	//
-	basic_block* routine::add_block() {
+	basic_block* routine::add_block(u64 ip) {
 		dirty_cfg();
 
 		auto blk = make_rc<basic_block>();
 		blk->rtn	 = this;
 		blk->name = next_blk_name++;
+		blk->ip	 = ip;
+		if (ip != NO_LABEL) {
+			block_index.try_emplace(ip, blk.get());
+		}
 		
 		if (blocks.empty()) {
 			entry_point = blk;
@@ -22,6 +26,9 @@ namespace retro::ir {
 		dirty_cfg();
 		RC_ASSERT(b->predecessors.empty());
 		RC_ASSERT(b->successors.empty());
+		if (auto it = block_index.find(b->ip); it != block_index.end() && it->second == b) {
+			block_index.erase(it);
+		}
 		for (auto it = blocks.begin();; ++it) {
 			RC_ASSERT(it != blocks.end());
 			if (it->get() == b) {
@@ -31,6 +38,61 @@ namespace retro::ir {
 		}
 		RC_UNREACHABLE();
 	}
+	size_t routine::del_unreachable_blocks() {
+		u64 mark = graph::monotonic_counter();
+		graph::dfs(entry_point.get(), [](basic_block*) {}, false, mark);
+
+		std::vector<basic_block*> dead = {};
+		for (auto& bb : blocks) {
+			if (bb->tmp_monotonic != mark)
+				dead.emplace_back(bb.get());
+		}
+
+		// Erase the instructions first, keeping them alive until none is left as they may use each other, then the edges between the blocks.
+		//
+		std::vector<ref<insn>> erased = {};
+		for (auto* bb : dead) {
+			while (auto* i = bb->back())
+				erased.emplace_back(i->erase());
+		}
+		erased.clear();
+		for (auto* bb : dead) {
+			while (!bb->successors.empty())
+				bb->del_jump(bb->successors.back().get());
+		}
+		for (auto* bb : dead)
+			del_block(bb);
+		return dead.size();
+	}
+
+	// Finds the block whose IP range contains the given IP, or the one starting at it.
+	// - Walks back over the blocks overlapping the ones after them, as a misaligned block starting within a longer one would
+	//   otherwise shadow it.
+	//
+	basic_block* routine::find_block(u64 ip) const {
+		auto it = block_index.upper_bound(ip);
+		if (it == block_index.begin()) {
+			return nullptr;
+		}
+		auto* bb = (--it)->second;
+		if (bb->ip != it->first) {
+			return nullptr;
+		}
+		if (bb->ip == ip || ip < bb->end_ip) {
+			return bb;
+		}
+		for (u64 lo = bb->ip; it != block_index.begin();) {
+			auto* prev = (--it)->second;
+			if (prev->ip != it->first || prev->end_ip <= lo) {
+				break;
+			}
+			if (ip < prev->end_ip) {
+				return prev;
+			}
+			lo = prev->ip;
+		}
+		return nullptr;
+	}
 
 	// Topologically sorts the basic block list.
 	//
@@ -5,6 +5,7 @@
 #include <retro/ir/routine.hpp>
 #include <retro/ir/insn.hpp>
 #include <retro/ir/z3x.hpp>
+#include <retro/opt/pass_manager.hpp>
 #include <retro/llvm/clang.hpp>
 #include <retro/bind/js.hpp>
 
@@ -14,33 +15,16 @@
 #undef assert
 
 namespace retro::bind {
-	// Scheduler.
+	// Durations are exposed as milliseconds.
 	//
-	template<>
-	struct type_descriptor<neo::scheduler> : user_class<neo::scheduler> {
-		inline static constexpr const char* name = "Scheduler";
-
-		template<typename Proto>
-		static void write(Proto& proto) {
-			proto.add_static_method("create", []() { return std::make_unique<neo::scheduler>(); });
-			proto.add_static_method("getDefault", []() { return &neo::scheduler::default_instance; });
-
-			proto.add_method("clear", [](neo::scheduler* sc) { sc->clear(); });
-			proto.add_method("suspend", [](neo::scheduler* sc) { sc->suspend(); });
-			proto.add_method("resume", [](neo::scheduler* sc) { sc->resume(); });
-			proto.add_async_method("wait", [](neo::scheduler* sc) { sc->wait_until_empty(); });
-
-			proto.add_property("suspended", [](neo::scheduler* sc) { return sc->is_suspended(); });
-			proto.add_property("remainingTasks", [](neo::scheduler* sc) { return (u32) sc->num_remaining_tasks(); });
-		}
-	};
+	static f64 to_ms(duration d) { return chrono::duration<f64, std::milli>(d).count(); }
 
 	// Task<T>.
 	//
 	struct task_wrapper {
 		ref<neo::task_state> ref;
 		coroutine_handle<> handle;
-		void (*queue_fn)(task_wrapper* self, void* out, const void* eng, neo::scheduler* s);
+		neo::task_state* (*detach_fn)(task_wrapper* self, void* out, const void* eng);
 		~task_wrapper() {
 			if (handle)
 				handle.destroy();
@@ -54,11 +38,12 @@ namespace retro::bind {
 		value from(const Engine& context, neo::task<T> task) const {
 			auto wrapper		= std::make_unique_for_overwrite<task_wrapper>();
 			wrapper->handle	= coroutine_handle<>::from_address(task.handle.release().address());
-			wrapper->queue_fn = +[](task_wrapper* self, void* out, const void* _eng, neo::scheduler* s) {
-				auto			 handle = std::exchange(self->handle, nullptr);
-				neo::task<T> ts{&coroutine_handle<promise>::from_address(handle.address()).promise()};
-				self->ref = ts.handle.promise().get_task_state();
-				*(value*) out = value::make(*(const Engine*) _eng, ts.queue(*s));
+			wrapper->detach_fn = +[](task_wrapper* self, void* out, const void* _eng) {
+				auto	handle = std::exchange(self->handle, nullptr);
+				auto* ts		 = coroutine_handle<promise>::from_address(handle.address()).promise().get_task_state();
+				self->ref		 = ts;
+				*(value*) out	 = value::make(*(const Engine*) _eng, neo::promise<T>{ts});
+				return ts;
 			};
 			return value::make(context, std::move(wrapper));
 		}
@@ -90,23 +75,182 @@ namespace retro::bind {
 			proto.add_property("error", [](task_wrapper* ts) {
 				return ts->ref && ts->ref->promise_error();
 			});
+			proto.add_property("queueLatency", [](task_wrapper* ts) -> std::optional<f64> {
+				if (!ts->ref || !ts->ref->telemetry.slices)
+					return std::nullopt;
+				return to_ms(ts->ref->telemetry.queue_latency());
+			});
+			proto.add_property("runTime", [](task_wrapper* ts) {
+				return ts->ref ? to_ms(ts->ref->telemetry.run_time) : 0.0;
+			});
+			proto.add_property("slices", [](task_wrapper* ts) {
+				return ts->ref ? ts->ref->telemetry.slices : 0u;
+			});
+			proto.add_property("checkpoints", [](task_wrapper* ts) {
+				return ts->ref ? ts->ref->telemetry.checkpoints : 0u;
+			});
+			proto.add_property("cancelPoint", [](task_wrapper* ts) -> std::optional<i32> {
+				if (!ts->ref || ts->ref->telemetry.cancel_point < 0)
+					return std::nullopt;
+				return ts->ref->telemetry.cancel_point;
+			});
 			proto.add_method("cancel", [](task_wrapper* ts) {
 				if (ts->ref == nullptr) {
 					throw std::runtime_error{"Task is not queued!"};
 				}
 				return ts->ref->promise_cancel();
 			});
+			proto.add_method("setPriority", [](task_wrapper* ts, neo::priority prio) {
+				if (ts->ref == nullptr) {
+					throw std::runtime_error{"Task is not queued!"};
+				}
+				ts->ref->promise_set_priority(prio);
+			});
+			proto.add_method("boost", [](task_wrapper* ts, neo::priority prio) {
+				if (ts->ref == nullptr) {
+					throw std::runtime_error{"Task is not queued!"};
+				}
+				ts->ref->promise_boost(prio);
+			});
 			proto.add_method("queue", [](const engine& eng, task_wrapper* ts, std::optional<neo::scheduler*> sc) {
 				if (ts->ref != nullptr) {
 					throw std::runtime_error{"Task is already queued!"};
 				}
 				value out;
-				ts->queue_fn(ts, &out, &eng, sc.value_or(&neo::scheduler::default_instance));
+				sc.value_or(&neo::scheduler::default_instance)->insert(ts->detach_fn(ts, &out, &eng));
 				return out;
 			});
 		}
 	};
 
+	// Scheduler.
+	//
+	template<>
+	struct type_descriptor<neo::scheduler> : user_class<neo::scheduler> {
+		inline static constexpr const char* name = "Scheduler";
+
+		template<typename Proto>
+		static void write(Proto& proto) {
+			using engine = typename Proto::engine_type;
+			using value	 = typename engine::value_type;
+			using array	 = typename engine::array_type;
+			using object = typename engine::object_type;
+
+			proto.add_static_method("create", [](std::optional<u32> n) { return std::make_unique<neo::scheduler>(n.value_or(0)); });
+			proto.add_static_method("getDefault", []() { return &neo::scheduler::default_instance; });
+			proto.add_static_method("createDeterministic", [](std::optional<u64> seed) {
+				auto sc = std::make_unique<neo::scheduler>(1, neo::schedule_mode::deterministic);
+				sc->set_seed(seed.value_or(0));
+				return sc;
+			});
+			proto.add_static_method("getTopology", [](const engine& eng) {
+				auto& topo = platform::get_topology();
+				array cpus = array::make(eng, topo.cpus.size());
+				for (size_t i = 0; i != topo.cpus.size(); i++) {
+					auto&	 c	  = topo.cpus[i];
+					object cpu = object::make(eng, 5);
+					cpu.set("id", c.id);
+					cpu.set("node", c.node);
+					cpu.set("package", c.package);
+					cpu.set("core", c.core);
+					cpu.set("smt", c.smt);
+					cpus.set(i, cpu);
+				}
+				object result = object::make(eng, 2);
+				result.set("numNodes", topo.num_nodes);
+				result.set("cpus", cpus);
+				return result;
+			});
+
+			proto.add_method("queueBatch", [](const engine& eng, neo::scheduler* sc, const array& tasks, std::optional<neo::priority> prio) {
+				std::vector<task_wrapper*> wrappers(tasks.length());
+				for (size_t i = 0; i != wrappers.size(); i++) {
+					wrappers[i] = tasks.get(i).template as<task_wrapper*>();
+					if (wrappers[i]->ref != nullptr) {
+						throw std::runtime_error{"Task is already queued!"};
+					}
+				}
+				auto sorted = wrappers;
+				range::sort(sorted);
+				if (std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end()) {
+					throw std::runtime_error{"Task is queued twice!"};
+				}
+
+				// Detach all tasks and insert them at once.
+				//
+				array							 result = array::make(eng, wrappers.size());
+				std::vector<neo::task_state*> list	 = {};
+				list.reserve(wrappers.size());
+				for (size_t i = 0; i != wrappers.size(); i++) {
+					value out;
+					list.emplace_back(wrappers[i]->detach_fn(wrappers[i], &out, &eng));
+					result.set(i, out);
+				}
+				sc->insert_many(list, prio.value_or(neo::priority::normal));
+				return result;
+			});
+			proto.add_method("setThreadCount", [](neo::scheduler* sc, u32 n) { sc->set_thread_count(n); });
+			proto.add_method("setIdlePolicy", [](neo::scheduler* sc, f64 spin_ms, f64 reclaim_ms) {
+				auto cvt = [](f64 ms) { return chrono::duration_cast<duration>(chrono::duration<f64, std::milli>(ms)); };
+				sc->set_idle_policy(cvt(spin_ms), cvt(reclaim_ms));
+			});
+			proto.add_method("setPlacement", [](neo::scheduler* sc, neo::pin_policy policy, std::optional<bool> node_local) {
+				sc->set_placement(policy, node_local.value_or(false));
+			});
+			proto.add_method("recordSchedule", [](neo::scheduler* sc, bool enable) { sc->record_schedule(enable); });
+			proto.add_method("getSchedule", [](neo::scheduler* sc) {
+				auto					schedule = sc->get_schedule();
+				std::vector<f64> result(schedule.begin(), schedule.end());
+				return result;
+			});
+			proto.add_method("replaySchedule", [](neo::scheduler* sc, const array& schedule) {
+				if (sc->get_mode() != neo::schedule_mode::deterministic) {
+					throw std::runtime_error{"Scheduler is not deterministic!"};
+				}
+				std::vector<u64> list(schedule.length());
+				for (size_t i = 0; i != list.size(); i++) {
+					list[i] = schedule.get(i).template as<u64>();
+				}
+				sc->replay_schedule(std::move(list));
+			});
+			proto.add_property("replayDiverged", [](neo::scheduler* sc) { return sc->has_replay_diverged(); });
+			proto.add_method("clear", [](neo::scheduler* sc) { sc->clear(); });
+			proto.add_method("suspend", [](neo::scheduler* sc) { sc->suspend(); });
+			proto.add_method("resume", [](neo::scheduler* sc) { sc->resume(); });
+			proto.add_async_method("wait", [](neo::scheduler* sc) { sc->wait_until_empty(); });
+
+			proto.add_method("getStatistics", [](const engine& eng, neo::scheduler* sc) {
+				auto stats = sc->get_statistics();
+				auto histogram = [&](const auto& h) {
+					array result = array::make(eng, h.size());
+					for (size_t i = 0; i != h.size(); i++)
+						result.set(i, f64(h[i]));
+					return result;
+				};
+
+				object result = object::make(eng, 9);
+				result.set("tasksStarted", f64(stats.tasks_started));
+				result.set("tasksFinished", f64(stats.tasks_finished));
+				result.set("tasksCancelled", f64(stats.tasks_cancelled));
+				result.set("slices", f64(stats.slices));
+				result.set("checkpoints", f64(stats.checkpoints));
+				result.set("queueLatency", to_ms(stats.queue_latency));
+				result.set("runTime", to_ms(stats.run_time));
+				result.set("queueLatencyHistogram", histogram(stats.queue_latency_histogram));
+				result.set("runTimeHistogram", histogram(stats.run_time_histogram));
+				return result;
+			});
+
+			proto.add_property("suspended", [](neo::scheduler* sc) { return sc->is_suspended(); });
+			proto.add_property("remainingTasks", [](neo::scheduler* sc) { return (u32) sc->num_remaining_tasks(); });
+			proto.add_property("threadCount", [](neo::scheduler* sc) { return (u32) sc->thread_count(); });
+			proto.add_property("liveThreads", [](neo::scheduler* sc) { return (u32) sc->num_threads(); });
+			proto.add_property("threadCapacity", [](neo::scheduler* sc) { return (u32) sc->thread_capacity(); });
+			proto.add_property("pinPolicy", [](neo::scheduler* sc) { return sc->get_pin_policy(); });
+			proto.add_property("nodeLocal", [](neo::scheduler* sc) { return sc->is_node_local(); });
+		}
+	};
+
 	// Machine instructions.
 	//
 	template<>
@@ -713,6 +857,9 @@ namespace retro::bind {
 		
 		template<typename Proto>
 		static void write(Proto& proto) {
+			using engine = typename Proto::engine_type;
+			using object = typename engine::object_type;
+
 			proto.add_property("name", [](core::image* i) { return i->name; });
 			proto.add_property("kind", [](core::image* i) { return i->kind; });
 			proto.add_property("baseAddress", [](core::image* i) { return i->base_address; });
@@ -729,8 +876,48 @@ namespace retro::bind {
 					result = result.subspan(0, len);
 				return result;
 			});
+			proto.add_method("write", [](core::image* img, u64 rva, std::vector<u8> data) { return img->write(rva, data); });
+			proto.add_method("relift", [](core::image* img) { return core::relift(img).in_group(img->task_group); });
 			proto.add_method("lift", [] (const js::engine& eng, core::image* img, u64 rva) {
-				return core::lift(img, rva);
+				return core::lift(img, rva).in_group(img->task_group);
+			});
+			proto.add_property("maxLiftBlocks", [](core::image* img) { return f64(img->lift_limits.max_blocks.load()); }, [](core::image* img, f64 n) { img->lift_limits.max_blocks = u64(n); });
+			proto.add_property("maxLiftInsns", [](core::image* img) { return f64(img->lift_limits.max_insns.load()); }, [](core::image* img, f64 n) { img->lift_limits.max_insns = u64(n); });
+			proto.add_property("maxLiftTime", [](core::image* img) { return img->lift_limits.max_time_ns.load() / 1e6; }, [](core::image* img, f64 ms) { img->lift_limits.max_time_ns = u64(ms * 1e6); });
+			proto.add_property("maxLiftZ3Time", [](core::image* img) { return img->lift_limits.max_z3_time_ns.load() / 1e6; }, [](core::image* img, f64 ms) { img->lift_limits.max_z3_time_ns = u64(ms * 1e6); });
+			proto.add_property("dedupEnabled", [](core::image* img) { return img->dedup.enabled.load(); }, [](core::image* img, bool v) { img->dedup.enabled = v; });
+			proto.add_method("getDedupStatistics", [](const engine& eng, core::image* img) {
+				auto&	 d		  = img->dedup;
+				object result = object::make(eng, 3);
+				{
+					std::lock_guard _g{d.lock};
+					result.set("fingerprints", f64(d.templates.size()));
+				}
+				result.set("hits", f64(d.hits.load()));
+				result.set("rejected", f64(d.rejected.load()));
+				return result;
+			});
+			proto.add_property("optPipeline", [](core::image* img) { return img->get_opt_pipeline(); }, [](core::image* img, std::string name) { img->set_opt_pipeline(std::move(name)); });
+			proto.add_method("cancelTasks", [](core::image* img) { img->task_group->cancel(); });
+			proto.add_property("numTasks", [](core::image* img) { return (u32) img->task_group->size(); });
+			proto.add_method("discover", [](core::image* img, std::optional<bool> code_refs) {
+				return core::discover(img, {.code_refs = code_refs.value_or(false)}).in_group(img->task_group);
+			});
+			proto.add_method("predecode", [](core::image* img) { return core::predecode(img).in_group(img->task_group); });
+			proto.add_method("clearDecodeCache", [](core::image* img) { img->decode_cache.clear(); });
+			proto.add_property("decodeCacheSize", [](core::image* img) { return (u32) img->decode_cache.size(); });
+			proto.add_property("decodeCacheCapacity", [](core::image* img) { return (u32) img->decode_cache.capacity.load(); }, [](core::image* img, u32 n) { img->decode_cache.capacity = n; });
+			proto.add_method("getDiscoveryProgress", [](const engine& eng, core::image* img) {
+				auto&	 p		  = img->discovery;
+				object result = object::make(eng, 7);
+				result.set("rounds", f64(p.rounds.load()));
+				result.set("methodsQueued", f64(p.methods_queued.load()));
+				result.set("methodsLifted", f64(p.methods_lifted.load()));
+				result.set("methodsFailed", f64(p.methods_failed.load()));
+				result.set("blocksLifted", f64(p.blocks_lifted.load()));
+				result.set("insnsLifted", f64(p.insns_lifted.load()));
+				result.set("methodsTruncated", f64(p.methods_truncated.load()));
+				return result;
 			});
 
 
@@ -776,6 +963,7 @@ namespace retro::bind {
 			proto.add_async_method("loadImageInMemory", [](core::workspace* ws, std::vector<u8> data, std::optional<ldr::handle> ldr) {
 				return ws->load_image_in_memory(data, ldr.value_or(std::nullopt)).value();
 			});
+			proto.add_method("closeImage", [](core::workspace* ws, core::image* img) { return ws->close_image(img); });
 		}
 	};
 };
@@ -785,6 +973,7 @@ using namespace retro;
 using Engine = bind::js::engine; // template<typename Engine>
 static void export_api(const Engine& eng, const Engine::object_type& mod) {
 	using object = typename Engine::object_type;
+	using array = typename Engine::array_type;
 	using function = typename Engine::function_type;
 
 	/*
@@ -853,6 +1042,54 @@ static void export_api(const Engine& eng, const Engine::object_type& mod) {
 	}));
 	clang.freeze();
 	mod.set("Clang", clang);
+
+	auto opt = object::make(eng, 6);
+	opt.set("getPasses", function::make(eng, "opt.getPasses", [](const Engine& eng) {
+		auto  passes = ir::opt::get_passes();
+		array result = array::make(eng, passes.size());
+		for (size_t i = 0; i != passes.size(); i++) {
+			auto*	 p	  = passes[i];
+			object entry = object::make(eng, 5);
+			entry.set("name", p->name);
+			entry.set("isBlockPass", p->is_block_pass());
+			entry.set("runs", f64(p->runs.load()));
+			entry.set("changes", f64(p->changes.load()));
+			entry.set("time", p->time_ns.load() / 1e6);
+			result.set(i, entry);
+		}
+		return result;
+	}));
+	opt.set("resetStatistics", function::make(eng, "opt.resetStatistics", []() {
+		for (auto* p : ir::opt::get_passes()) {
+			p->runs	  = 0;
+			p->changes = 0;
+			p->time_ns = 0;
+		}
+	}));
+	opt.set("getPipelines", function::make(eng, "opt.getPipelines", []() { return ir::opt::get_pipelines(); }));
+	opt.set("getPipeline", function::make(eng, "opt.getPipeline", [](const Engine& eng, std::string name) -> std::optional<object> {
+		auto pl = ir::opt::get_pipeline(name);
+		if (!pl)
+			return std::nullopt;
+		std::vector<std::string_view> passes;
+		for (auto* p : pl->passes)
+			passes.emplace_back(p->name);
+		object result = object::make(eng, 2);
+		result.set("passes", passes);
+		result.set("maxIterations", pl->max_iterations);
+		return result;
+	}));
+	opt.set("setPipeline", function::make(eng, "opt.setPipeline", [](std::string name, std::vector<std::string> passes, std::optional<u32> max_iterations) {
+		ir::opt::set_pipeline(name, passes, max_iterations.value_or(1)).raise();
+	}));
+	opt.set("runOnBlock", function::make(eng, "opt.runOnBlock", [](std::string name, ir::basic_block* bb) {
+		auto pl = ir::opt::get_pipeline(name);
+		if (!pl)
+			throw std::runtime_error("Unknown pipeline.");
+		return (u32) ir::opt::run_pipeline(*pl, bb);
+	}));
+	opt.freeze();
+	mod.set("Optimizer", opt);
 	mod.freeze();
 }
 
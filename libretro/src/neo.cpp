@@ -1,45 +1,887 @@
 #include <retro/neo.hpp>
 #include <retro/platform.hpp>
 
+namespace retro::neo::frame_pool {
+	// Size classes, 64 byte granularity up to 4KB and powers of two up to 64KB.
+	//
+	static constexpr size_t num_classes	= 68;
+	static constexpr u32		cache_limit = 64;
+	static constexpr u32		batch_size	= 32;
+	static constexpr size_t shrink_min	= 1024;
+	static constexpr size_t class_size(size_t i) { return i < 64 ? (i + 1) * 64 : (4096ull << (i - 63)); }
+
+	u8 class_of(size_t n) {
+		if (n <= 4096) [[likely]] {
+			return u8((std::max<size_t>(n, 1) + 63) / 64 - 1);
+		} else if (n <= class_size(num_classes - 1)) {
+			return u8(63 + std::bit_width((n - 1) >> 12));
+		} else {
+			return unpooled;
+		}
+	}
+
+	// Free block and the class lists, the first word is left untouched for the trailing weak reference release.
+	//
+	struct free_block {
+		u64			reserved;
+		free_block* next;
+	};
+	struct global_class {
+		spinlock		lock	= {};
+		free_block* head	= nullptr;
+		size_t		count = 0;
+	};
+
+	// Thread cache, counters are only written by the owning thread.
+	//
+	static void bump(std::atomic<u64>& counter, u64 n = 1) { counter.store(counter.load(std::memory_order::relaxed) + n, std::memory_order::relaxed); }
+	struct thread_cache {
+		thread_cache* prev = this;
+		thread_cache* next = this;
+
+		free_block* heads[num_classes]  = {};
+		u32			counts[num_classes] = {};
+
+		std::atomic<u64> allocs	  = 0;
+		std::atomic<u64> frees	  = 0;
+		std::atomic<u64> hits	  = 0;
+		std::atomic<u64> misses	  = 0;
+		std::atomic<u64> retained = 0;
+
+		thread_cache();
+		~thread_cache();
+	};
+
+	// Global state.
+	//
+	static global_class				  global_classes[num_classes] = {};
+	static std::atomic<u64>			  global_retained				 = 0;
+	static spinlock					  cache_list_lock				 = {};
+	static list::head<thread_cache> cache_list					 = {};
+	static statistics					  retired_stats				 = {};
+	static thread_local thread_cache local_cache					 = {};
+	static thread_local bool			local_cache_dead			 = false;
+
+	// Gets the cache of the calling thread, null once it was torn down, e.g. when static destructors release frames at exit.
+	//
+	static thread_cache* get_local_cache() { return local_cache_dead ? nullptr : &local_cache; }
+
+	// Moves up to n blocks between the thread cache and the global list.
+	//
+	static void refill(thread_cache& c, u8 cls) {
+		auto& g = global_classes[cls];
+		std::lock_guard _g{g.lock};
+		free_block* it = g.head;
+		u32			n	= 0;
+		for (free_block* prev = nullptr; it && n != batch_size; n++) {
+			prev = std::exchange(it, it->next);
+			prev->next = c.heads[cls];
+			c.heads[cls] = prev;
+		}
+		g.head = it;
+		g.count -= n;
+		c.counts[cls] += n;
+		global_retained.fetch_sub(n * class_size(cls), std::memory_order::relaxed);
+		bump(c.retained, n * class_size(cls));
+	}
+	static void flush(thread_cache& c, u8 cls, u32 n) {
+		free_block* first = c.heads[cls];
+		if (!first)
+			return;
+		free_block* last = first;
+		u32			cnt  = 1;
+		for (; cnt != n && last->next; cnt++)
+			last = last->next;
+		c.heads[cls] = std::exchange(last->next, nullptr);
+		c.counts[cls] -= cnt;
+		bump(c.retained, -u64(cnt * class_size(cls)));
+
+		auto& g = global_classes[cls];
+		std::lock_guard _g{g.lock};
+		last->next = g.head;
+		g.head	  = first;
+		g.count += cnt;
+		global_retained.fetch_add(cnt * class_size(cls), std::memory_order::relaxed);
+	}
+
+	// Registration of the thread caches.
+	//
+	thread_cache::thread_cache() {
+		std::lock_guard _g{cache_list_lock};
+		list::link_before(cache_list.entry(), this);
+	}
+	thread_cache::~thread_cache() {
+		for (u8 cls = 0; cls != num_classes; cls++) {
+			while (counts[cls])
+				flush(*this, cls, UINT32_MAX);
+		}
+		std::lock_guard _g{cache_list_lock};
+		list::unlink(this);
+		retired_stats.live_frames += allocs - frees;
+		retired_stats.pool_hits += hits;
+		retired_stats.pool_misses += misses;
+		local_cache_dead = true;
+	}
+
+	// Allocation and release.
+	//
+	void* allocate(u8 cls) {
+		auto* cp = get_local_cache();
+		if (!cp) [[unlikely]] {
+			std::lock_guard _g{cache_list_lock};
+			retired_stats.live_frames++;
+			retired_stats.pool_misses++;
+			return heap::allocate(class_size(cls));
+		}
+		auto& c = *cp;
+		bump(c.allocs);
+		if (!c.heads[cls]) [[unlikely]]
+			refill(c, cls);
+
+		if (auto* b = c.heads[cls]) [[likely]] {
+			c.heads[cls] = b->next;
+			c.counts[cls]--;
+			bump(c.hits);
+			bump(c.retained, -u64(class_size(cls)));
+			return b;
+		}
+		bump(c.misses);
+		return heap::allocate(class_size(cls));
+	}
+	bool deallocate(void* p, u8 cls) {
+		auto* cp = get_local_cache();
+		if (!cp) [[unlikely]] {
+			std::lock_guard _g{cache_list_lock};
+			retired_stats.live_frames--;
+			return false;
+		}
+		auto& c = *cp;
+		bump(c.frees);
+
+		// Flush before linking so that the block being released is never published to the other threads by this call.
+		//
+		if (c.counts[cls] >= cache_limit) [[unlikely]]
+			flush(c, cls, batch_size);
+
+		auto* b		 = (free_block*) p;
+		b->next		 = c.heads[cls];
+		c.heads[cls] = b;
+		c.counts[cls]++;
+		bump(c.retained, class_size(cls));
+		return true;
+	}
+
+	bool shrink(void* p, u8 cls, size_t n) {
+		if (class_size(cls) < n + shrink_min)
+			return false;
+		heap::shrink(p, n);
+		if (auto* c = get_local_cache()) {
+			bump(c->frees);
+		} else {
+			std::lock_guard _g{cache_list_lock};
+			retired_stats.live_frames--;
+		}
+		return true;
+	}
+
+	// Statistics and trimming.
+	//
+	statistics stats() {
+		std::lock_guard _g{cache_list_lock};
+		statistics		 result = retired_stats;
+		result.bytes_retained	 = global_retained.load(std::memory_order::relaxed);
+		for (auto* c : cache_list) {
+			result.live_frames += c->allocs.load(std::memory_order::relaxed) - c->frees.load(std::memory_order::relaxed);
+			result.pool_hits += c->hits.load(std::memory_order::relaxed);
+			result.pool_misses += c->misses.load(std::memory_order::relaxed);
+			result.bytes_retained += c->retained.load(std::memory_order::relaxed);
+		}
+		return result;
+	}
+	void trim() {
+		auto* c = get_local_cache();
+		for (u8 cls = 0; cls != num_classes; cls++) {
+			while (c && c->counts[cls])
+				flush(*c, cls, UINT32_MAX);
+
+			auto&		  g = global_classes[cls];
+			free_block* list;
+			{
+				std::lock_guard _g{g.lock};
+				list = std::exchange(g.head, nullptr);
+				global_retained.fetch_sub(g.count * class_size(cls), std::memory_order::relaxed);
+				g.count = 0;
+			}
+			while (list) {
+				heap::deallocate(std::exchange(list, list->next));
+			}
+		}
+	}
+};
+
 namespace retro::neo {
 	static size_t ideal_thread_count				= std::thread::hardware_concurrency();
 	scheduler	  scheduler::default_instance = {std::thread::hardware_concurrency()};
 
-	// Pushes a task for rescheduling.
+	// Worker identification, used to push locally spawned tasks into the local queue.
 	//
-	void scheduler::push(task_state* w) {
-		std::lock_guard _g{lock};
-		list::link_before(queue.entry(), w);
-		signal.release();
+	static thread_local scheduler* current_scheduler = nullptr;
+	static thread_local size_t		 current_worker	 = 0;
+
+	// Task being executed by this thread, used to pick the subtask arena.
+	//
+	static thread_local task_state* current_task = nullptr;
+
+	// Scheduler of the calling worker thread, the default one if not called from a worker.
+	//
+	scheduler& scheduler::current() { return current_scheduler ? *current_scheduler : default_instance; }
+
+	// Subtask arena.
+	//
+	void* subtask_arena::allocate(size_t n) {
+		n = align_up(n + sizeof(frame_header), 0x10);
+		if (top + n > chunk_size) [[unlikely]]
+			return nullptr;
+		if (!base) [[unlikely]]
+			base = (u8*) frame_pool::allocate(frame_pool::class_of(chunk_size));
+
+		auto* h	= (frame_header*) (base + top);
+		h->arena = this;
+		h->prev	= last;
+		h->freed = 0;
+		last		= top;
+		top += u32(n);
+		return h + 1;
+	}
+	void subtask_arena::deallocate(frame_header* h) {
+		h->freed = 1;
+		while (last != UINT32_MAX) {
+			auto* t = (frame_header*) (base + last);
+			if (!t->freed)
+				break;
+			top  = last;
+			last = t->prev;
+		}
+	}
+	void subtask_arena::release() {
+		RC_ASSERT(top == 0);
+		if (base && !frame_pool::deallocate(base, frame_pool::class_of(chunk_size)))
+			heap::deallocate(base);
+		base = nullptr;
+	}
+
+	// Subtask frame allocation.
+	//
+	void* subtask_promise_base::operator new(size_t n) {
+		if (auto* ts = current_task) {
+			if (void* p = ts->arena.allocate(n)) [[likely]]
+				return p;
+		}
+		auto* h	= (subtask_arena::frame_header*) heap::allocate(n + sizeof(subtask_arena::frame_header));
+		h->arena = nullptr;
+		return h + 1;
+	}
+	void subtask_promise_base::operator delete(void* p) {
+		auto* h = (subtask_arena::frame_header*) p - 1;
+		if (h->arena)
+			h->arena->deallocate(h);
+		else
+			heap::deallocate(h);
 	}
 
-	// Pops a task promise for execution.
+	// Cancellation group membership.
 	//
-	task_state* scheduler::pop() {
+	void cancel_group::add(task_state* ts) {
 		std::lock_guard _g{lock};
-		if (auto* w = queue.front()) {
-			list::unlink(w);
+		if (cancelled.load(std::memory_order::relaxed))
+			ts->cancellation_signal = true;
+		ts->group_prev = nullptr;
+		ts->group_next = members;
+		if (members)
+			members->group_prev = ts;
+		members = ts;
+		member_count++;
+	}
+	void cancel_group::remove(task_state* ts) {
+		std::lock_guard _g{lock};
+		if (ts->group_prev)
+			ts->group_prev->group_next = ts->group_next;
+		else
+			members = ts->group_next;
+		if (ts->group_next)
+			ts->group_next->group_prev = ts->group_prev;
+		ts->group_prev = nullptr;
+		ts->group_next = nullptr;
+		member_count--;
+	}
+
+	// Cancels every member, the queued ones are dropped from their schedulers right away.
+	//
+	void cancel_group::cancel() {
+		std::vector<scheduler*> schedulers = {};
+		{
+			std::lock_guard _g{lock};
+			cancelled.store(true, std::memory_order::relaxed);
+			for (auto* ts = members; ts; ts = ts->group_next) {
+				ts->promise_request_cancel();
+				if (std::find(schedulers.begin(), schedulers.end(), ts->sched) == schedulers.end())
+					schedulers.emplace_back(ts->sched);
+			}
+		}
+		for (auto* s : schedulers)
+			s->clear(this);
+	}
+
+	// Wakes a parked task, re-queueing it into its scheduler if the worker already released it.
+	//
+	void task_state::task_unpark() {
+		auto st = park_state.load(std::memory_order::relaxed);
+		while (true) {
+			// If the worker is still holding the task, let it know it should re-queue it.
+			//
+			if (st == park_id::parking) {
+				if (park_state.compare_exchange_weak(st, park_id::woken, std::memory_order::acq_rel))
+					return;
+			}
+			// If it was released, take ownership and push it.
+			//
+			else if (st == park_id::parked) {
+				if (park_state.compare_exchange_weak(st, park_id::running, std::memory_order::acq_rel)) {
+					sched->push(this);
+					return;
+				}
+			}
+			// Otherwise already running or woken.
+			//
+			else {
+				return;
+			}
+		}
+	}
+
+	// Changes the priority of a pending task, propagating raises to the tasks being awaited on.
+	//
+	void task_state::promise_set_priority(neo::priority p) {
+		if (state != id::pending)
+			return;
+		auto prev = std::exchange(prio, p);
+		if (sched)
+			sched->requeue(this);
+
+		if (prev < p) {
+			ref<task_state>					dep;
+			std::vector<ref<task_state>> deps;
+			{
+				std::lock_guard _g{dep_lock};
+				dep = awaiting;
+				deps.assign(awaiting_all.begin(), awaiting_all.end());
+			}
+			if (dep)
+				dep->promise_boost(p);
+			for (auto& d : deps)
+				d->promise_boost(p);
+		}
+	}
+
+	// Moves a queued task to the level matching its current priority.
+	//
+	void scheduler::requeue(task_state* ts) {
+		size_t lvl = priority_level(ts->prio);
+		while (true) {
+			// If not queued, the new priority is picked up on the next push.
+			//
+			u32 idx = ts->queue_index.load(std::memory_order::acquire);
+			if (idx == UINT32_MAX)
+				return;
+
+			// Retry if it moved in between.
+			//
+			auto& q = queue_list[idx];
+			q.lock.lock();
+			if (ts->queue_index.load(std::memory_order::relaxed) != idx) {
+				q.lock.unlock();
+				continue;
+			}
+			if (ts->queue_level == lvl) {
+				q.lock.unlock();
+				return;
+			}
+
+			// Move it keeping its queue time so that it preserves its age.
+			//
+			if (!ts->queue_level)
+				urgent_count.fetch_sub(1, std::memory_order::relaxed);
+			list::unlink(ts);
+			list::link_before(q.levels[lvl].entry(), ts);
+			ts->queue_level = u8(lvl);
+			q.lock.unlock();
+
+			if (!lvl) {
+				urgent_count.fetch_add(1, std::memory_order::relaxed);
+				wake();
+				preempt(lvl);
+			}
+			return;
+		}
+	}
+
+	// Checkpoint slow path, refills the budget and checks for cancellation, preemption and the end of the slice.
+	//
+	task_state::tick_id task_state::task_checkpoint() {
+		// Account for the consumed ticks.
+		//
+		auto* b = tick_budget;
+		telemetry.checkpoints += tick_refill - u32(std::max(b->load(std::memory_order::relaxed), 0));
+
+		// In deterministic mode the budget is the slice itself.
+		//
+		if (sched->mode == schedule_mode::deterministic) [[unlikely]] {
+			b->store(i32(tick_refill), std::memory_order::relaxed);
+			if (cancellation_signal) {
+				telemetry.cancel_point = i32(telemetry.checkpoints);
+				return tick_id::cancel;
+			}
+			return tick_id::yield;
+		}
+
+		// Adapt the refill so that the slow path runs about once per interval.
+		//
+		timestamp t		  = now();
+		duration	 elapsed = t - tick_last;
+		if (elapsed < checkpoint_interval / 2 && tick_refill < max_tick_refill)
+			tick_refill *= 2;
+		else if (elapsed > checkpoint_interval * 2 && tick_refill > 1)
+			tick_refill /= 2;
+		tick_last = t;
+		b->store(i32(tick_refill), std::memory_order::relaxed);
+
+		// Check the signals.
+		//
+		if (cancellation_signal) [[unlikely]] {
+			telemetry.cancel_point = i32(telemetry.checkpoints);
+			return tick_id::cancel;
+		}
+		if (*preempt_signal || slice_end < t)
+			return tick_id::yield;
+		return tick_id::resume;
+	}
+
+	// Wakes up to n workers if there are any parked, spawning new ones if below the target.
+	//
+	void scheduler::wake(size_t n) {
+		// Pairs with the fences in thread_main and retire, either we observe the idle or retired worker or it observes our task.
+		//
+		std::atomic_thread_fence(std::memory_order::seq_cst);
+		u32 idle = idle_count.load(std::memory_order::relaxed);
+		if (idle) {
+			signal.release(std::min<size_t>(idle, n));
+		}
+		if (n > idle && live_count.load(std::memory_order::relaxed) < thread_target.load(std::memory_order::relaxed)) [[unlikely]] {
+			grow(n - idle);
+		}
+	}
+
+	// Spawns up to n workers in the free slots below the target.
+	//
+	void scheduler::grow(size_t n) {
+		std::lock_guard _g{thread_lock};
+		if (termination_signal)
+			return;
+		size_t target = thread_target.load(std::memory_order::relaxed);
+		for (size_t i = 0; i != target && n; i++) {
+			auto& w = worker_list[i];
+			if (w.alive)
+				continue;
+
+			// Join the retired thread if any, it is past the point of touching the scheduler.
+			//
+			if (w.thread.joinable())
+				w.thread.join();
+			w.alive = true;
+			live_count.fetch_add(1, std::memory_order::relaxed);
+			w.thread = std::thread(thread_main, this, i);
+			n--;
+		}
+	}
+
+	// Retires the worker unless there is queued work left to pick up, returns true if the thread should exit.
+	//
+	bool scheduler::retire(size_t worker_index, bool force) {
+		std::lock_guard _g{thread_lock};
+		live_count.fetch_sub(1, std::memory_order::relaxed);
+
+		// Pairs with the fence in wake, either the pusher observes the decrement and spawns a replacement once we release the lock, or we observe the task.
+		//
+		std::atomic_thread_fence(std::memory_order::seq_cst);
+		if (!termination_signal && !force && has_queued()) {
+			live_count.fetch_add(1, std::memory_order::relaxed);
+			return false;
+		}
+		worker_list[worker_index].alive = false;
+		worker_list[worker_index].idle.store(true, std::memory_order::relaxed);
+		return true;
+	}
+
+	// Returns true if any of the queues has a task.
+	//
+	bool scheduler::has_queued() const {
+		for (size_t i = 0; i != queue_count; i++) {
+			if (!queue_list[i].empty())
+				return true;
+		}
+		return false;
+	}
+
+	// Changes the number of worker threads.
+	//
+	void scheduler::set_thread_count(size_t n) {
+		n = std::clamp<size_t>(n, 1, worker_capacity);
+		size_t prev = thread_target.exchange(u32(n));
+		if (prev < n) {
+			grow(n - prev);
+		} else if (prev > n) {
+			// Wake the parked workers so that the extra ones can exit.
+			//
+			signal.release(worker_capacity);
+		}
+	}
+
+	// Pushes a task for execution, if reschedule is set, places it behind every other local task.
+	//
+	void scheduler::push(task_state* w, bool reschedule) {
+		// Pick the local queue if we're a worker of this scheduler, otherwise distribute in a round-robin fashion.
+		//
+		size_t idx;
+		if (current_scheduler == this) {
+			idx = current_worker % queue_count;
+		} else {
+			idx = inject_counter.fetch_add(1, std::memory_order::relaxed) % num_active_queues();
+		}
+
+		// Link into the queue of the matching level.
+		//
+		size_t lvl	  = priority_level(w->prio);
+		w->queue_time = clock();
+		auto& q		  = queue_list[idx];
+		auto& l		  = q.levels[lvl];
+		q.lock.lock();
+		if (reschedule && mode == schedule_mode::work_stealing)
+			list::link_after(l.entry(), w);
+		else
+			list::link_before(l.entry(), w);
+		w->queue_level = u8(lvl);
+		w->queue_index.store(u32(idx), std::memory_order::release);
+		q.size.fetch_add(1, std::memory_order::relaxed);
+		q.lock.unlock();
+
+		// Interactive tasks preempt lower levels if nobody is idle.
+		//
+		if (lvl == 0) {
+			urgent_count.fetch_add(1, std::memory_order::relaxed);
+			wake();
+			preempt(lvl);
+		} else {
+			wake();
+		}
+	}
+
+	// Asks a worker running a task below the given level to yield at its next checkpoint.
+	//
+	void scheduler::preempt(size_t level) {
+		if (idle_count.load(std::memory_order::relaxed) || mode == schedule_mode::deterministic)
+			return;
+		for (size_t i = 0; i != worker_capacity; i++) {
+			auto&	 w	  = worker_list[i];
+			size_t lvl = w.running_level.load(std::memory_order::relaxed);
+			if (level < lvl && lvl != num_priority_levels) {
+				w.preempt = true;
+				w.tick_budget.store(0, std::memory_order::relaxed);
+				return;
+			}
+		}
+	}
+
+	// Takes the next task from a locked queue, considering levels up to max_level.
+	//
+	task_state* scheduler::take(run_queue& q, bool lifo, timestamp t, size_t max_level) {
+		// Interactive level is always served first.
+		//
+		if (auto* w = lifo ? q.levels[0].back() : q.levels[0].front()) {
+			unlink_queued(q, w);
 			return w;
 		}
+
+		// Pick the level with the earliest deadline, taking the oldest task if it is already overdue.
+		//
+		size_t	 best			 = 0;
+		timestamp best_deadline = {};
+		for (size_t lvl = 1; lvl <= max_level; lvl++) {
+			if (auto* w = q.levels[lvl].front()) {
+				timestamp deadline = w->queue_time + lvl * priority_aging_interval;
+				if (!best || deadline < best_deadline) {
+					best			  = lvl;
+					best_deadline = deadline;
+				}
+			}
+		}
+		if (!best)
+			return nullptr;
+
+		auto* w = (lifo && t < best_deadline) ? q.levels[best].back() : q.levels[best].front();
+		unlink_queued(q, w);
+		return w;
+	}
+
+	// Unlinks a task from its locked queue.
+	//
+	void scheduler::unlink_queued(run_queue& q, task_state* ts) {
+		if (!ts->queue_level)
+			urgent_count.fetch_sub(1, std::memory_order::relaxed);
+		list::unlink(ts);
+		q.size.fetch_sub(1, std::memory_order::relaxed);
+		ts->queue_index.store(UINT32_MAX, std::memory_order::relaxed);
+	}
+
+	// Clock used for queue times and aging, virtual in deterministic mode.
+	//
+	timestamp scheduler::clock() const {
+		if (mode == schedule_mode::deterministic)
+			return timestamp{} + time_slice_coeff * i64(virtual_slices.load(std::memory_order::relaxed));
+		return now();
+	}
+
+	// Pops the next task in deterministic mode, following the replayed schedule if any.
+	//
+	task_state* scheduler::pop_deterministic() {
+		auto&			  q = queue_list[0];
+		std::lock_guard _g{q.lock};
+		std::lock_guard _t{trace_lock};
+
+		task_state* w = nullptr;
+		if (replay_cursor != replay_trace.size()) {
+			u64 id = replay_trace[replay_cursor];
+			for (auto& l : q.levels) {
+				for (auto* e : l) {
+					if (e->seq == id) {
+						w = e;
+						break;
+					}
+				}
+				if (w)
+					break;
+			}
+			if (w) {
+				replay_cursor++;
+				unlink_queued(q, w);
+			} else if (std::all_of(std::begin(q.levels), std::end(q.levels), [](auto& l) { return l.empty(); })) {
+				// Wait for the task to be queued if nothing is.
+				//
+				return nullptr;
+			} else {
+				// The only worker is not running anything that could queue it, so the run diverged from the schedule, fall back
+				// to the regular order instead of waiting forever.
+				//
+				replay_diverged = true;
+				replay_cursor	 = replay_trace.size();
+			}
+		}
+
+		if (!w && rng_seed) {
+			// Pick a random task from the highest level.
+			//
+			for (auto& l : q.levels) {
+				if (size_t n = l.size()) {
+					rng_seed ^= rng_seed << 13;
+					rng_seed ^= rng_seed >> 7;
+					rng_seed ^= rng_seed << 17;
+					w = *std::next(l.begin(), rng_seed % n);
+					unlink_queued(q, w);
+					break;
+				}
+			}
+		} else if (!w) {
+			w = take(q, false, clock());
+		}
+
+		if (w) {
+			virtual_slices.fetch_add(1, std::memory_order::relaxed);
+			if (recording)
+				trace.emplace_back(w->seq);
+		}
+		return w;
+	}
+
+	// Deterministic mode controls.
+	//
+	void scheduler::set_seed(u64 seed) {
+		std::lock_guard _g{trace_lock};
+		rng_seed = seed;
+	}
+	void scheduler::record_schedule(bool enable) {
+		std::lock_guard _g{trace_lock};
+		recording = enable;
+		if (enable)
+			trace.clear();
+	}
+	std::vector<u64> scheduler::get_schedule() const {
+		std::lock_guard _g{trace_lock};
+		return trace;
+	}
+	bool scheduler::has_replay_diverged() const {
+		std::lock_guard _g{trace_lock};
+		return replay_diverged;
+	}
+	void scheduler::replay_schedule(std::vector<u64> schedule) {
+		{
+			std::lock_guard _g{trace_lock};
+			replay_trace	 = std::move(schedule);
+			replay_cursor	 = 0;
+			replay_diverged = false;
+		}
+		wake();
+	}
+
+	// Steals from the front of the other queues, starting at a random victim.
+	//
+	task_state* scheduler::steal(size_t local, timestamp t, size_t max_level) {
+		if (queue_count <= 1)
+			return nullptr;
+
+		thread_local u64 seed = platform::srng() | 1;
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+
+		// Queues map one to one to workers in work-stealing mode.
+		//
+		bool node_local = node_local_steal && mode == schedule_mode::work_stealing;
+		u32  node		 = worker_list[local].node.load(std::memory_order::relaxed);
+
+		size_t start = seed % queue_count;
+		for (size_t n = 0; n != queue_count; n++) {
+			size_t victim = (start + n) % queue_count;
+			if (victim == local)
+				continue;
+
+			// If keeping tasks on their node, only cross it when the owner has run out of work.
+			//
+			auto& vw = worker_list[victim];
+			if (node_local && vw.node.load(std::memory_order::relaxed) != node && !vw.idle.load(std::memory_order::relaxed))
+				continue;
+
+			auto& q = queue_list[victim];
+			if (q.empty())
+				continue;
+			std::lock_guard _g{q.lock};
+			if (auto* w = take(q, false, t, max_level)) {
+				return w;
+			}
+		}
 		return nullptr;
 	}
 
+	// Pops a task promise for execution, starting with the local queue and then stealing.
+	//
+	task_state* scheduler::pop(size_t worker_index) {
+		if (mode == schedule_mode::deterministic)
+			return pop_deterministic();
+
+		size_t	 local = worker_index % queue_count;
+		timestamp t		= now();
+		auto&		 q		= queue_list[local];
+
+		// If there are interactive tasks queued elsewhere, steal them before running local work.
+		//
+		if (urgent_count.load(std::memory_order::relaxed)) [[unlikely]] {
+			bool local_urgent;
+			{
+				std::lock_guard _g{q.lock};
+				local_urgent = !q.levels[0].empty();
+			}
+			if (!local_urgent) {
+				if (auto* w = steal(local, t, 0))
+					return w;
+			}
+		}
+
+		// Try the local queue, LIFO in work-stealing mode, FIFO otherwise.
+		//
+		{
+			std::lock_guard _g{q.lock};
+			if (auto* w = take(q, mode == schedule_mode::work_stealing, t))
+				return w;
+		}
+		return steal(local, t);
+	}
+
+	// Computes the CPUs a worker should be pinned to and its node, empty if it should use the affinity mask as is.
+	//
+	std::vector<u32> scheduler::placement_of(size_t worker_index, u32& node) const {
+		node = 0;
+		if (pin == pin_policy::none)
+			return {};
+
+		// Gather the CPUs allowed by the mask, it can only exclude the first 64.
+		//
+		u64										 mask		= affinity_mask;
+		std::vector<const platform::cpu_info*> allowed = {};
+		std::vector<u32>							 nodes	= {};
+		for (auto& c : platform::get_topology().cpus) {
+			if (c.id < 64 ? ((mask >> c.id) & 1) : mask == ~0ull) {
+				allowed.emplace_back(&c);
+				if (nodes.empty() || nodes.back() != c.node)
+					nodes.emplace_back(c.node);
+			}
+		}
+		if (allowed.empty())
+			return {};
+
+		// Compact placement walks the topology order.
+		//
+		if (pin == pin_policy::compact) {
+			auto* c = allowed[worker_index % allowed.size()];
+			node	  = c->node;
+			return {c->id};
+		}
+
+		// Otherwise pick the node round-robin.
+		//
+		node = nodes[worker_index % nodes.size()];
+		std::vector<const platform::cpu_info*> local = {};
+		for (auto* c : allowed)
+			if (c->node == node)
+				local.emplace_back(c);
+
+		if (pin == pin_policy::per_node) {
+			std::vector<u32> result = {};
+			for (auto* c : local)
+				result.emplace_back(c->id);
+			return result;
+		}
+		std::stable_sort(local.begin(), local.end(), [](auto* a, auto* b) { return a->smt < b->smt; });
+		return {local[(worker_index / nodes.size()) % local.size()]->id};
+	}
+
 	// Worker thread entry point.
 	//
-	void scheduler::thread_main(scheduler* schd) {
-		u64 affinity = schd->affinity_mask;
-		platform::set_affinity(affinity);
+	void scheduler::thread_main(scheduler* schd, size_t worker_index) {
+		current_scheduler = schd;
+		current_worker		= worker_index;
 
+		u32 placement = ~0u;
+		schd->worker_list[worker_index].idle.store(false, std::memory_order::relaxed);
 		while (true) {
-			// Wait for a signal.
+			// If the placement changed, update the affinity.
 			//
-			schd->signal.acquire();
-
-			// If affinity changed, update.
-			//
-			if (u64 new_affinity = schd->affinity_mask; new_affinity != affinity) [[unlikely]] {
-				platform::set_affinity(new_affinity);
-				affinity = new_affinity;
+			if (u32 epoch = schd->placement_epoch.load(std::memory_order::acquire); epoch != placement) [[unlikely]] {
+				u32  node = 0;
+				auto cpus = schd->placement_of(worker_index, node);
+				if (cpus.empty())
+					platform::set_affinity(u64(schd->affinity_mask));
+				else
+					platform::set_affinity(cpus);
+				schd->worker_list[worker_index].node.store(node, std::memory_order::relaxed);
+				placement = epoch;
 			}
 
 			// If termination is requested, return.
@@ -47,82 +889,313 @@ namespace retro::neo {
 			if (schd->termination_signal) [[unlikely]]
 				return;
 
+			// If the pool was shrunk below us, retire.
+			//
+			if (worker_index >= schd->thread_target.load(std::memory_order::relaxed)) [[unlikely]] {
+				if (schd->retire(worker_index, true)) {
+					// Let another worker pick up what was left in our queue.
+					//
+					schd->signal.release(1);
+					return;
+				}
+			}
+
 			// Wait until scheduler is resumed.
 			//
 			while(auto n = schd->suspended.load()) [[unlikely]] {
 				schd->suspended.wait(n);
 			}
 
-			// Pop a task and execute it.
+			// Clear any preemption request, the pop below observes the task that caused it.
+			//
+			auto& worker	 = schd->worker_list[worker_index];
+			worker.preempt = false;
+
+			// Pop a task, if there are none, park the worker.
 			//
-			if (task_state* ts = schd->pop()) {
-				// Resume the task if no cancellation signal is set.
+			task_state* ts = schd->pop(worker_index);
+			if (!ts) {
+				// Announce that we're idle and keep checking for a while to avoid missing a push and paying the wake-up latency.
+				//
+				schd->idle_count.fetch_add(1, std::memory_order::relaxed);
+				worker.idle.store(true, std::memory_order::relaxed);
+				std::atomic_thread_fence(std::memory_order::seq_cst);
+				timestamp spin_end = now() + schd->spin_duration.load(std::memory_order::relaxed);
+				while (!schd->termination_signal) {
+					if ((ts = schd->pop(worker_index)) || now() >= spin_end)
+						break;
+					intrin::yield();
+				}
+
+				// Park until signalled, exit if idle for too long.
 				//
-				if (!ts->cancellation_signal) {
-					ts->slice_end = now() + u32(ts->prio) * time_slice_coeff;
-					ts->coro_current.resume();
+				if (!ts) {
+					bool		signalled = true;
+					duration timeout	 = schd->idle_timeout.load(std::memory_order::relaxed);
+					if (timeout != duration{})
+						signalled = schd->signal.try_acquire_for(timeout);
+					else
+						schd->signal.acquire();
+					schd->idle_count.fetch_sub(1, std::memory_order::relaxed);
+					if (!signalled && schd->retire(worker_index, false))
+						return;
+					worker.idle.store(false, std::memory_order::relaxed);
+					continue;
+				}
+				schd->idle_count.fetch_sub(1, std::memory_order::relaxed);
+				worker.idle.store(false, std::memory_order::relaxed);
+			}
 
-					if (ts->state == task_state::id::pending && !ts->coro_promise.done()) {
+			// Resume the task if no cancellation signal is set.
+			//
+			auto& stats = worker.stats;
+			if (!ts->cancellation_signal) {
+				timestamp t0 = now();
+				if (!ts->telemetry.slices++) {
+					ts->telemetry.first_run_time = t0;
+					stats.tasks_started++;
+					stats.queue_latency += ts->telemetry.queue_latency();
+					stats.queue_latency_histogram[scheduler_statistics::histogram_index(ts->telemetry.queue_latency())]++;
+				}
+
+				ts->slice_end		 = t0 + u32(ts->prio) * time_slice_coeff;
+				if (schd->mode == schedule_mode::deterministic)
+					ts->tick_refill = u32(ts->prio) * deterministic_slice_ticks;
+				ts->preempt_signal = &worker.preempt;
+				ts->tick_budget	 = &worker.tick_budget;
+				ts->tick_last		 = t0;
+				worker.tick_budget.store(i32(ts->tick_refill), std::memory_order::relaxed);
+				worker.running_level.store(u8(priority_level(ts->prio)), std::memory_order::relaxed);
+				current_task = ts;
+				ts->coro_current.resume();
+				current_task = nullptr;
+				worker.running_level.store(u8(num_priority_levels), std::memory_order::relaxed);
+				ts->telemetry.run_time += now() - t0;
+				ts->telemetry.checkpoints += ts->tick_refill - u32(std::max(worker.tick_budget.load(std::memory_order::relaxed), 0));
+
+				if (ts->state == task_state::id::pending && !ts->coro_promise.done()) {
+					// If the task is awaiting a promise, release it unless it was already woken.
+					//
+					if (ts->park_state.load(std::memory_order::acquire) != task_state::park_id::running) {
+						auto expected = task_state::park_id::parking;
+						if (ts->park_state.compare_exchange_strong(expected, task_state::park_id::parked, std::memory_order::acq_rel)) {
+							continue;
+						}
+						ts->park_state.store(task_state::park_id::running, std::memory_order::relaxed);
 						schd->push(ts);
 						continue;
 					}
+					schd->push(ts, true);
+					continue;
 				}
-				// Otherwise cancel.
-				//
-				else {
-					ts->task_cancel();
-				}
-
-				// Decrement remaining task count, notify if it reaches zero.
-				//
-				if (!--schd->remaining_task_count)
-					schd->remaining_task_count.notify_all();
-				ts->coro_promise.destroy();
 			}
+			// Otherwise cancel.
+			//
+			else {
+				ts->telemetry.cancel_point = i32(ts->telemetry.checkpoints);
+				ts->task_cancel();
+			}
+
+			// Record the task statistics.
+			//
+			stats.tasks_finished++;
+			stats.tasks_cancelled += ts->state == task_state::id::cancelled;
+			stats.slices += ts->telemetry.slices;
+			stats.checkpoints += ts->telemetry.checkpoints;
+			stats.run_time += ts->telemetry.run_time;
+			stats.run_time_histogram[scheduler_statistics::histogram_index(ts->telemetry.run_time)]++;
+
+			// Decrement remaining task count, notify if it reaches zero.
+			//
+			if (!--schd->remaining_task_count)
+				schd->remaining_task_count.notify_all();
+			ts->coro_promise.destroy();
 		}
 	}
 
 	// Constructs a scheduler with the given number of threads.
 	//
-	scheduler::scheduler(size_t n) {
+	scheduler::scheduler(size_t n, schedule_mode mode, size_t capacity) : mode(mode) {
 		if (n == 0)
 			n = ideal_thread_count;
-		while (n) {
-			thread_list.emplace_back(thread_main, this);
-			--n;
-		}
+		worker_capacity = std::max({n, capacity, ideal_thread_count});
+		if (mode == schedule_mode::deterministic)
+			n = worker_capacity = 1;
+
+		queue_count = mode == schedule_mode::work_stealing ? worker_capacity : 1;
+		queue_list	= std::make_unique<run_queue[]>(queue_count);
+		worker_list = std::make_unique<worker_state[]>(worker_capacity);
+		thread_target.store(u32(n), std::memory_order::relaxed);
+		grow(n);
 	}
 	
-	// Cancels all tasks.
+	// Statistics.
 	//
-	void scheduler::clear() {
-		std::lock_guard _g{lock};
-		while (auto* ts = queue.front()) {
-			ts->task_cancel();
-			list::unlink(ts);
-			ts->coro_promise.destroy();
+	scheduler_statistics& scheduler_statistics::operator+=(const scheduler_statistics& o) {
+		tasks_started += o.tasks_started;
+		tasks_finished += o.tasks_finished;
+		tasks_cancelled += o.tasks_cancelled;
+		slices += o.slices;
+		checkpoints += o.checkpoints;
+		queue_latency += o.queue_latency;
+		run_time += o.run_time;
+		for (size_t i = 0; i != histogram_size; i++) {
+			queue_latency_histogram[i] += o.queue_latency_histogram[i];
+			run_time_histogram[i] += o.run_time_histogram[i];
+		}
+		return *this;
+	}
+	scheduler_statistics scheduler::get_statistics() const {
+		scheduler_statistics result = {};
+		for (size_t i = 0; i != worker_capacity; i++) {
+			result += worker_list[i].stats;
 		}
 
-		remaining_task_count = 0;
-		remaining_task_count.notify_all();
+		// Tasks removed by clear never reach a worker.
+		//
+		u64 cleared = cleared_count.load(std::memory_order::relaxed);
+		result.tasks_finished += cleared;
+		result.tasks_cancelled += cleared;
+		return result;
+	}
+
+	// Cancels all queued tasks, or only those of the given group.
+	//
+	void scheduler::clear(const cancel_group* group) {
+		u64								count = 0;
+		std::vector<task_state*> list	= {};
+		do {
+			list.clear();
+			for (size_t i = 0; i != queue_count; i++) {
+				auto&			  q = queue_list[i];
+				std::lock_guard _g{q.lock};
+				for (auto& l : q.levels) {
+					for (auto it = l.begin(); it != l.end();) {
+						auto* ts = *it++;
+						if (group && ts->group.get() != group)
+							continue;
+						unlink_queued(q, ts);
+						list.emplace_back(ts);
+					}
+				}
+			}
+
+			// Cancel outside of the queue locks, finally clauses and frame destructors may wake or cancel other tasks, which we collect on the next pass.
+			//
+			for (auto* ts : list) {
+				ts->task_cancel();
+				ts->coro_promise.destroy();
+			}
+			count += list.size();
+		} while (!list.empty());
+
+		// Only discount the tasks we've removed, parked and running tasks will decrement on their own.
+		//
+		cleared_count += count;
+		if (count && !(remaining_task_count -= count))
+			remaining_task_count.notify_all();
+	}
+
+	// Joins the cancellation group of the task queueing it unless one was set explicitly.
+	//
+	static void join_group(task_state* ts) {
+		if (!ts->group && current_task)
+			ts->group = current_task->group;
+		if (ts->group)
+			ts->group->add(ts);
 	}
 
 	// Schedules a task.
 	//
 	void scheduler::insert(task_state* ts, priority prio) {
-		ts->prio = prio;
+		ts->prio								= prio;
+		ts->sched							= this;
+		ts->telemetry.enqueue_time = now();
+		ts->seq							= next_seq.fetch_add(1, std::memory_order::relaxed);
+		join_group(ts);
 		remaining_task_count++;
 		push(ts);
 	}
 
+	// Schedules a batch of tasks, linking them under a single lock acquisition per queue and waking the workers at once.
+	//
+	void scheduler::insert_many(std::span<task_state* const> list, priority prio) {
+		if (list.empty()) [[unlikely]]
+			return;
+		timestamp t	  = now();
+		timestamp qt  = clock();
+		size_t	 lvl = priority_level(prio);
+		u64		 seq = next_seq.fetch_add(list.size(), std::memory_order::relaxed);
+		for (auto* ts : list) {
+			ts->prio								= prio;
+			ts->sched							= this;
+			ts->seq								= seq++;
+			ts->queue_time						= qt;
+			ts->telemetry.enqueue_time = t;
+			join_group(ts);
+		}
+		if (lvl == 0)
+			urgent_count.fetch_add(u32(list.size()), std::memory_order::relaxed);
+		remaining_task_count += list.size();
+
+		// Spawned from a worker, keep it in the local queue and let the others steal, otherwise spread across the queues.
+		//
+		size_t first, spread;
+		if (current_scheduler == this) {
+			first	 = current_worker % queue_count;
+			spread = 1;
+		} else {
+			size_t active = num_active_queues();
+			spread		  = std::min(active, list.size());
+			first			  = inject_counter.fetch_add(u32(spread), std::memory_order::relaxed) % active;
+		}
+
+		// Build a detached chain for each queue and splice it in.
+		//
+		auto	 it	 = list.begin();
+		size_t base	 = list.size() / spread;
+		size_t extra = list.size() % spread;
+		for (size_t i = 0; i != spread; i++) {
+			size_t		idx	= (first + i) % queue_count;
+			task_state* chain = nullptr;
+			auto			from	= it;
+			for (size_t n = base + (i < extra ? 1 : 0); n != 0; n--) {
+				auto* ts			 = *it++;
+				ts->queue_level = u8(lvl);
+				if (chain)
+					list::link_before(chain, ts);
+				else
+					chain = ts;
+			}
+
+			// Publish the queue index only once linked into it, a concurrent requeue would otherwise unlink from the detached chain.
+			//
+			auto& q = queue_list[idx];
+			q.lock.lock();
+			list::splice_before(q.levels[lvl].entry(), chain);
+			q.size.fetch_add(size_t(it - from), std::memory_order::relaxed);
+			for (; from != it; ++from)
+				(*from)->queue_index.store(u32(idx), std::memory_order::release);
+			q.lock.unlock();
+		}
+		wake(list.size());
+		if (lvl == 0)
+			preempt(lvl);
+	}
+
 	// Handle cancellation of leftover tasks and thread deletion on destruction.
 	//
 	scheduler::~scheduler() {
-		termination_signal = true;
-		signal.release(UINT32_MAX);
+		{
+			std::lock_guard _g{thread_lock};
+			termination_signal = true;
+		}
+		signal.release(worker_capacity);
 		resume();
-		for (auto& t : thread_list)
-			t.join();
+		for (size_t i = 0; i != worker_capacity; i++) {
+			if (auto& t = worker_list[i].thread; t.joinable())
+				t.join();
+		}
 		clear();
 	}
 };
@@ -0,0 +1,107 @@
+#include <retro/opt/interface.hpp>
+#include <retro/opt/utility.hpp>
+#include <retro/arch/interface.hpp>
+#include <retro/robin_hood.hpp>
+
+namespace retro::ir::opt {
+	// State of a single evaluation.
+	// - Results are memoized per instruction, shared operands would otherwise be evaluated once per path reaching them.
+	//
+	struct eval_context {
+		function_view<constant(const insn*)> subst = {};
+		flat_umap<const insn*, constant>		 memo	 = {};
+	};
+
+	// Evaluates an instruction into a constant without modifying the IR.
+	//
+	static constant const_eval_uncached(const insn* i, eval_context& ctx, size_t max_depth);
+	static constant const_eval(const operand& op, eval_context& ctx, size_t max_depth) {
+		if (op.is_const())
+			return op.get_const();
+		auto* i = op.get_value()->get_if<insn>();
+		if (!i || max_depth == 0)
+			return {};
+		if (auto it = ctx.memo.find(i); it != ctx.memo.end())
+			return it->second;
+		auto result = const_eval_uncached(i, ctx, max_depth - 1);
+		ctx.memo.emplace(i, result);
+		return result;
+	}
+	static constant const_eval_uncached(const insn* i, eval_context& ctx, size_t max_depth) {
+		// Let the caller substitute it first.
+		//
+		if (ctx.subst) {
+			if (auto c = ctx.subst(i))
+				return c;
+		}
+
+		switch (i->op) {
+			case opcode::binop:
+			case opcode::cmp: {
+				auto lhs = const_eval(i->opr(1), ctx, max_depth);
+				if (!lhs)
+					return {};
+				auto rhs = const_eval(i->opr(2), ctx, max_depth);
+				if (!rhs)
+					return {};
+				return lhs.apply(i->opr(0).get_const().get<op>(), rhs);
+			}
+			case opcode::unop: {
+				auto rhs = const_eval(i->opr(1), ctx, max_depth);
+				if (!rhs)
+					return {};
+				return rhs.apply(i->opr(0).get_const().get<op>());
+			}
+			case opcode::select: {
+				auto cc = const_eval(i->opr(0), ctx, max_depth);
+				if (!cc)
+					return {};
+				return const_eval(i->opr(cc.get<bool>() ? 1 : 2), ctx, max_depth);
+			}
+			case opcode::cast: {
+				auto val = const_eval(i->opr(0), ctx, max_depth);
+				return val ? val.cast_zx(i->template_types[1]) : constant{};
+			}
+			case opcode::cast_sx: {
+				auto val = const_eval(i->opr(0), ctx, max_depth);
+				return val ? val.cast_sx(i->template_types[1]) : constant{};
+			}
+			case opcode::bitcast: {
+				auto val = const_eval(i->opr(0), ctx, max_depth);
+				return val ? val.bitcast(i->template_types[1]) : constant{};
+			}
+			case opcode::load_mem: {
+				auto adr = const_eval(i->opr(0), ctx, max_depth);
+				return adr ? load_const_value(i, adr.get_u64()) : constant{};
+			}
+
+			// Same local register propagation as z3x::to_expr, so that jump targets resolve without modifying the block.
+			//
+			case opcode::read_reg: {
+				auto rt = i->opr(0).get_const().get<arch::mreg>();
+				for (auto i2 : i->bb->rslice(const_cast<insn*>(i))) {
+					if (i2->desc().unk_reg_use)
+						break;
+					if (i2->op == opcode::write_reg && rt == i2->opr(0).get_const().get<arch::mreg>()) {
+						// Partial and full aliases of the register may be written with a different type, give up rather than mixing widths.
+						//
+						if (i2->opr(1).get_type() != i->get_type())
+							return {};
+						return const_eval(i2->opr(1), ctx, max_depth);
+					}
+				}
+				return {};
+			}
+			default:
+				return {};
+		}
+	}
+
+	// Evaluates an operand into a constant without modifying the IR, returns an empty constant if it is not one.
+	//
+	constant const_eval(const operand& op, function_view<constant(const insn*)> subst, size_t max_depth) {
+		eval_context ctx{subst};
+		return const_eval(op, ctx, max_depth);
+	}
+	constant const_eval(const operand& op, size_t max_depth) { return const_eval(op, nullptr, max_depth); }
+};
@@ -0,0 +1,207 @@
+#include <retro/opt/pass_manager.hpp>
+#include <retro/opt/interface.hpp>
+#include <retro/robin_hood.hpp>
+#include <retro/umutex.hpp>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+
+namespace retro::ir::opt {
+	// Errors.
+	//
+	RC_DEF_ERR(unknown_pass, "unknown optimization pass '%'")
+
+	// Runs the pass and records the statistics.
+	//
+	size_t pass::operator()(basic_block* bb) {
+		auto	 t0 = now();
+		size_t n	 = block_fn(bb);
+		time_ns.fetch_add(chrono::duration_cast<chrono::nanoseconds>(now() - t0).count(), std::memory_order::relaxed);
+		runs.fetch_add(1, std::memory_order::relaxed);
+		changes.fetch_add(n, std::memory_order::relaxed);
+		return n;
+	}
+	size_t pass::operator()(routine* rtn) {
+		auto	 t0 = now();
+		size_t n	 = routine_fn(rtn);
+		time_ns.fetch_add(chrono::duration_cast<chrono::nanoseconds>(now() - t0).count(), std::memory_order::relaxed);
+		runs.fetch_add(1, std::memory_order::relaxed);
+		changes.fetch_add(n, std::memory_order::relaxed);
+		return n;
+	}
+
+	// Registries, populated with the builtin passes and pipelines on first use.
+	//
+	struct registry {
+		shared_umutex										  mtx			= {};
+		std::vector<std::unique_ptr<pass>>			  passes		= {};
+		flat_umap<std::string, ref<const pipeline>> pipelines = {};
+
+		pass* add(std::string_view name, size_t (*bfn)(basic_block*), size_t (*rfn)(routine*)) {
+			std::unique_lock _g{mtx};
+			for (auto& p : passes) {
+				if (p->name == name) {
+					p->block_fn	  = bfn;
+					p->routine_fn = rfn;
+					return p.get();
+				}
+			}
+			auto& p		  = passes.emplace_back(std::make_unique<pass>());
+			p->name		  = name;
+			p->block_fn	  = bfn;
+			p->routine_fn = rfn;
+			return p.get();
+		}
+	};
+	static registry& get_registry() {
+		static registry* r = [] {
+			auto* r = new registry();
+			r->add("reg_move_prop", &init::reg_move_prop, nullptr);
+			r->add("reg_to_phi", nullptr, &init::reg_to_phi);
+			r->add("const_fold", &const_fold, nullptr);
+			r->add("const_load", &const_load, nullptr);
+			r->add("id_fold", &id_fold, nullptr);
+			r->add("ins_combine", &ins_combine, nullptr);
+
+			auto make_pipeline = [&](std::string_view name, std::initializer_list<std::string_view> passes, u32 max_iterations) {
+				auto pl				 = make_rc<pipeline>();
+				pl->name				 = name;
+				pl->max_iterations = max_iterations;
+				for (auto n : passes)
+					pl->passes.emplace_back(range::find_if(r->passes, [&](auto& p) { return p->name == n; })->get());
+				r->pipelines.emplace(std::string{name}, std::move(pl));
+			};
+
+			// Default pipeline applied after lifting.
+			//
+			make_pipeline("init", {"reg_move_prop", "const_fold", "const_load", "id_fold", "ins_combine", "const_fold", "id_fold"}, 1);
+
+			// Same passes ran to a fixed point.
+			//
+			make_pipeline("init-fixed", {"reg_move_prop", "const_fold", "const_load", "id_fold", "ins_combine"}, 8);
+
+			// No optimization.
+			//
+			make_pipeline("none", {}, 1);
+			return r;
+		}();
+		return *r;
+	}
+
+	// Pass registry.
+	//
+	pass* register_pass(std::string_view name, size_t (*fn)(basic_block*)) { return get_registry().add(name, fn, nullptr); }
+	pass* register_pass(std::string_view name, size_t (*fn)(routine*)) { return get_registry().add(name, nullptr, fn); }
+	pass* find_pass(std::string_view name) {
+		auto&				  r = get_registry();
+		std::shared_lock _g{r.mtx};
+		for (auto& p : r.passes)
+			if (p->name == name)
+				return p.get();
+		return nullptr;
+	}
+	std::vector<pass*> get_passes() {
+		auto&				  r = get_registry();
+		std::shared_lock _g{r.mtx};
+		std::vector<pass*> result = {};
+		for (auto& p : r.passes)
+			result.emplace_back(p.get());
+		return result;
+	}
+
+	// Pipeline registry.
+	//
+	diag::lazy set_pipeline(std::string_view name, const std::vector<std::string>& passes, u32 max_iterations) {
+		auto pl				 = make_rc<pipeline>();
+		pl->name				 = name;
+		pl->max_iterations = std::max<u32>(max_iterations, 1);
+		for (auto& n : passes) {
+			auto* p = find_pass(n);
+			if (!p)
+				return err::unknown_pass(n);
+			pl->passes.emplace_back(p);
+		}
+
+		auto&				  r = get_registry();
+		std::unique_lock _g{r.mtx};
+		r.pipelines[std::string{name}] = std::move(pl);
+		return diag::ok;
+	}
+	ref<const pipeline> get_pipeline(std::string_view name) {
+		auto&				  r = get_registry();
+		std::shared_lock _g{r.mtx};
+		if (auto it = r.pipelines.find(std::string{name}); it != r.pipelines.end())
+			return it->second;
+		return nullptr;
+	}
+	std::vector<std::string> get_pipelines() {
+		auto&				  r = get_registry();
+		std::shared_lock _g{r.mtx};
+		std::vector<std::string> result = {};
+		for (auto& [k, v] : r.pipelines)
+			result.emplace_back(k);
+		range::sort(result);
+		return result;
+	}
+
+	// Runs a range of block passes once on a block.
+	//
+	static size_t run_block_stage(std::span<pass* const> stage, basic_block* bb) {
+		size_t n = 0;
+		for (auto* p : stage)
+			n += (*p)(bb);
+		return n;
+	}
+
+	// Runs a pipeline on a single block, ignoring routine passes, returns the number of changes.
+	//
+	size_t run_pipeline(const pipeline& pl, basic_block* bb) {
+		size_t total = 0;
+		for (u32 it = 0; it != pl.max_iterations; it++) {
+			size_t n = 0;
+			for (auto* p : pl.passes)
+				if (p->is_block_pass())
+					n += (*p)(bb);
+			total += n;
+			if (!n)
+				break;
+		}
+		return total;
+	}
+
+	// Runs a pipeline on a routine, returns the number of changes.
+	// - Block passes run one block at a time, once a routine pass such as reg_to_phi created values used across blocks, passes
+	//   running on different blocks would race on the shared use lists.
+	//
+	neo::subtask<size_t> run_pipeline(ref<const pipeline> pl, ref<routine> rtn) {
+		size_t total = 0;
+		for (u32 it = 0; it != pl->max_iterations; it++) {
+			size_t n = 0;
+			for (size_t i = 0; i != pl->passes.size();) {
+				// Routine passes run on their own.
+				//
+				if (!pl->passes[i]->is_block_pass()) {
+					co_await neo::checkpoint{};
+					n += (*pl->passes[i])(rtn.get());
+					i++;
+					continue;
+				}
+
+				// Consecutive block passes run on each block in turn.
+				//
+				size_t begin = i;
+				while (i != pl->passes.size() && pl->passes[i]->is_block_pass())
+					i++;
+				auto stage = std::span{pl->passes}.subspan(begin, i - begin);
+				for (size_t b = 0; b != rtn->blocks.size(); b++) {
+					co_await neo::checkpoint{};
+					n += run_block_stage(stage, rtn->blocks[b]);
+				}
+			}
+			total += n;
+			if (!n)
+				break;
+		}
+		co_return total;
+	}
+};
@@ -144,6 +144,123 @@ namespace retro::platform {
 #else
 	void set_affinity(u64 mask) { RC_UNUSED(mask); }
 #endif
+#if RC_UNIX
+	void set_affinity(std::span<const u32> cpus) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (u32 i : cpus) {
+			if (i < CPU_SETSIZE) {
+				CPU_SET(i, &set);
+			}
+		}
+		sched_setaffinity(0, sizeof(cpu_set_t), &set);
+	}
+#else
+	void set_affinity(std::span<const u32> cpus) {
+		u64 mask = 0;
+		for (u32 i : cpus) {
+			if (i < 64) {
+				mask |= 1ull << i;
+			}
+		}
+		set_affinity(mask ? mask : ~0ull);
+	}
+#endif
+
+	// CPU topology discovery.
+	//
+#if RC_UNIX
+	static std::string read_sys(const std::filesystem::path& path) {
+		std::ifstream fs{path};
+		std::string	  result = {};
+		std::getline(fs, result);
+		return result;
+	}
+	static std::vector<u32> parse_cpu_list(std::string_view s) {
+		std::vector<u32> result = {};
+		while (!s.empty()) {
+			auto part = s.substr(0, s.find(','));
+			s.remove_prefix(std::min(s.size(), part.size() + 1));
+
+			u32 lo = 0, hi = 0;
+			if (auto n = sscanf(std::string{part}.c_str(), "%u-%u", &lo, &hi); n == 1) {
+				hi = lo;
+			} else if (n != 2) {
+				continue;
+			}
+			for (u32 i = lo; i <= hi; i++)
+				result.emplace_back(i);
+		}
+		return result;
+	}
+	static cpu_topology discover_topology() {
+		const std::filesystem::path cpu_root	= "/sys/devices/system/cpu";
+		const std::filesystem::path node_root = "/sys/devices/system/node";
+
+		cpu_topology result = {};
+		for (u32 id : parse_cpu_list(read_sys(cpu_root / "online"))) {
+			cpu_info info = {.id = id};
+			auto		 dir	= cpu_root / fmt::str("cpu%u", id) / "topology";
+			info.package	= (u32) strtoul(read_sys(dir / "physical_package_id").c_str(), nullptr, 10);
+			info.core		= (u32) strtoul(read_sys(dir / "core_id").c_str(), nullptr, 10);
+			result.cpus.emplace_back(info);
+		}
+
+		// Assign the NUMA nodes, renumbering them densely.
+		//
+		std::error_code ec;
+		u32				 node = 0;
+		for (u32 n = 0; n != 1024; n++) {
+			auto dir = node_root / fmt::str("node%u", n);
+			if (!std::filesystem::exists(dir, ec))
+				continue;
+			bool any = false;
+			for (u32 id : parse_cpu_list(read_sys(dir / "cpulist"))) {
+				for (auto& c : result.cpus) {
+					if (c.id == id) {
+						c.node = node;
+						any	 = true;
+					}
+				}
+			}
+			node += any;
+		}
+		result.num_nodes = std::max(node, 1u);
+		return result;
+	}
+#else
+	static cpu_topology discover_topology() {
+		cpu_topology result = {};
+		return result;
+	}
+#endif
+	const cpu_topology& get_topology() {
+		static const cpu_topology topology = [] {
+			cpu_topology t = discover_topology();
+
+			// Fallback to a flat topology if discovery failed.
+			//
+			if (t.cpus.empty()) {
+				t.num_nodes = 1;
+				for (u32 i = 0; i != std::max(std::thread::hardware_concurrency(), 1u); i++)
+					t.cpus.push_back({.id = i, .core = i});
+			}
+
+			// Sort in compact order and number the SMT siblings.
+			//
+			range::sort(t.cpus, [](const cpu_info& a, const cpu_info& b) {
+				return std::tie(a.node, a.package, a.core, a.id) < std::tie(b.node, b.package, b.core, b.id);
+			});
+			for (size_t i = 1; i != t.cpus.size(); i++) {
+				auto& p = t.cpus[i - 1];
+				auto& c = t.cpus[i];
+				if (p.node == c.node && p.package == c.package && p.core == c.core)
+					c.smt = p.smt + 1;
+			}
+			return t;
+		}();
+		return topology;
+	}
 
 
 #if RC_WINDOWS
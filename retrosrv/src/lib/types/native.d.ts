@@ -435,17 +435,55 @@ declare module LibRetro {
 
 	// Scheduler and tasks.
 	//
+	interface SchedulerStatistics {
+		tasksStarted: number;
+		tasksFinished: number;
+		tasksCancelled: number;
+		slices: number;
+		checkpoints: number;
+		queueLatency: number;            // Total, in milliseconds.
+		runTime: number;                 // Total, in milliseconds.
+		queueLatencyHistogram: number[]; // Bucket i counts durations below 2^i microseconds.
+		runTimeHistogram: number[];
+	}
+	interface CpuInfo {
+		id: number;
+		node: number;
+		package: number;
+		core: number;
+		smt: number;
+	}
+	interface CpuTopology {
+		numNodes: number;
+		cpus: CpuInfo[];
+	}
 	declare class Scheduler extends RefCounted {
-		static create(): Scheduler;
+		static create(threads: ?number): Scheduler;
 		static getDefault(): Scheduler;
-
+		static createDeterministic(seed: ?bigint): Scheduler;
+		static getTopology(): CpuTopology;
+
+		queueBatch<T>(tasks: Task<T>[], prio: ?number): Promise<T>[];
+		setThreadCount(n: number);
+		setIdlePolicy(spinMs: number, reclaimMs: number); // Zero reclaim keeps idle threads alive.
+		setPlacement(policy: number, nodeLocal: ?boolean); // None, compact, scatter, per-node.
+		recordSchedule(enable: boolean);
+		getSchedule(): number[];
+		replaySchedule(schedule: number[]);
+		get replayDiverged(): boolean; // Set if the run stopped following the replayed schedule, it then continues in the regular order.
 		clear();
 		suspend();
 		resume();
 		async wait();
+		getStatistics(): SchedulerStatistics;
 
 		get suspended(): boolean;
 		get remainingTasks(): number;
+		get threadCount(): number;
+		get liveThreads(): number;
+		get threadCapacity(): number;
+		get pinPolicy(): number;
+		get nodeLocal(): boolean;
 	}
 	declare class Task<T> extends RefCounted {
 		get queued(): boolean;
@@ -455,12 +493,34 @@ declare module LibRetro {
 		get success(): boolean;
 		get error(): boolean;
 
+		get queueLatency(): ?number;
+		get runTime(): number;
+		get slices(): number;
+		get checkpoints(): number;
+		get cancelPoint(): ?number;
+
 		cancel(): boolean;
+		setPriority(prio: number);
+		boost(prio: number);
 		queue(sc: ?Scheduler = null): Promise<T>;
 	}
 
 	// Image instance.
 	//
+	interface DiscoveryProgress {
+		rounds: number;
+		methodsQueued: number;
+		methodsLifted: number;
+		methodsFailed: number;
+		blocksLifted: number;
+		insnsLifted: number;
+		methodsTruncated: number; // Methods whose lifting hit the budget.
+	}
+	declare interface DedupStatistics {
+		fingerprints: number; // Unique fingerprints seen.
+		hits: number; // Methods rebased from an identical one.
+		rejected: number; // Fingerprint matches that did not verify.
+	}
 	declare class Image extends RefCounted {
 		get name(): string;
 		get kind(): ImageKind;
@@ -472,9 +532,26 @@ declare module LibRetro {
 		get isEnvSupervisor(): boolean;
 		get entryPoints(): bigint[];
 
-		lift(rva: bigint | number): Task<?Routine>;
+		lift(rva: bigint | number): Task<?Routine>; // Joins the image's cancellation group.
+		cancelTasks();
+		get numTasks(): number;
+		discover(followCodeRefs: ?boolean): Task<bigint>; // Seeds from entry points, symbols and relocs, then follows calls.
+		getDiscoveryProgress(): DiscoveryProgress;
+		predecode(): Task<bigint>; // Linear sweep of the executable sections into the decode cache.
+		clearDecodeCache();
+		get decodeCacheSize(): number;
+		decodeCacheCapacity: number;
+		maxLiftBlocks: number; // Per method lifting budget, zero means unlimited.
+		maxLiftInsns: number;
+		maxLiftTime: number; // Milliseconds.
+		maxLiftZ3Time: number; // Milliseconds, soft cap checked between queries.
+		dedupEnabled: boolean; // Rebases identical methods from the first one lifted.
+		getDedupStatistics(): DedupStatistics;
+		optPipeline: string; // Pipeline applied after lifting, falls back to "init" if it does not exist.
 
 		slice(rva: bigint | number, length: bigint | number): Buffer;
+		write(rva: bigint | number, data: Buffer): boolean; // Records the range as dirty, see relift. Fails while tasks or lifts are running.
+		relift(): Task<bigint>; // Re-lifts the methods depending on the ranges written since the last call.
 	}
 
 	// Workspace type.
@@ -485,6 +562,7 @@ declare module LibRetro {
 
 		async loadImage(path: string, ldr: ?Loader = null): Promise<Image>;
 		async loadImageInMemory(data: Buffer, ldr: ?Loader = null): Promise<Image>;
+		closeImage(img: Image): boolean; // Also cancels the tasks working on it.
 	}
 
 	// LLVM.
@@ -495,4 +573,26 @@ declare module LibRetro {
 		async function compile(source: string, arguments?: string = null): Promise<Buffer>;
 		async function compileTestCase(source: string, arguments?: string = null): Promise<Buffer>;
 	}
+
+	// Optimizer.
+	//
+	declare interface PassStatistics {
+		name: string;
+		isBlockPass: boolean;
+		runs: number;
+		changes: number;
+		time: number; // Milliseconds.
+	}
+	declare interface Pipeline {
+		passes: string[];
+		maxIterations: number;
+	}
+	declare namespace Optimizer {
+		function getPasses(): PassStatistics[];
+		function resetStatistics();
+		function getPipelines(): string[];
+		function getPipeline(name: string): ?Pipeline;
+		function setPipeline(name: string, passes: string[], maxIterations: ?number = 1);
+		function runOnBlock(name: string, bb: BasicBlock): number; // Ignores routine passes.
+	}
 }